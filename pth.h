@@ -54,6 +54,8 @@ typedef _sigset_t	sigset_t;
 /* These are needed for pipe support.  Sigh.  */
 int pth_pipe (int filedes[2], int inherit_idx);
 int pth_close (int fd);
+int pth_close_async (int fd);
+int pth_close_many (int *fds, int nfds);
 
 
 /* We need to define value for the how argument of pth_sigmask.  This
@@ -83,8 +85,9 @@ enum
 #define PTH_MUTEX_INITIALIZED  (1<<0)
 #define PTH_MUTEX_LOCKED       (1<<1)
 
-/* Note: We can't do static initialization, thus we don't define the
-   initializer PTH_MUTEX_INIT.  */
+/* Static initializer for a mutex.  The mutex object is allocated on
+   first use.  */
+#define PTH_MUTEX_INIT  0
 
 /* Read-write lock values.  */
 enum
@@ -93,11 +96,27 @@ enum
     PTH_RWLOCK_RW
   };
 
-/* Note: We can't do static initialization, thus we don't define the
-   initializer PTH_RWLOCK_INIT.  */
+/* Static initializer for a read-write lock.  */
+#define PTH_RWLOCK_INIT  0
 
+/* Return values of pth_barrier_reach.  */
+#define PTH_BARRIER_HEADLIGHT  (-1)
+#define PTH_BARRIER_TAILLIGHT  (-2)
 
-#define PTH_KEY_INIT	       (1<<0)
+
+/* Cancellation states.  */
+#define PTH_CANCEL_ENABLE       (1<<0)
+#define PTH_CANCEL_DISABLE      (1<<1)
+#define PTH_CANCEL_ASYNCHRONOUS (1<<2)
+#define PTH_CANCEL_DEFERRED     (1<<3)
+#define PTH_CANCEL_DEFAULT      (PTH_CANCEL_ENABLE|PTH_CANCEL_DEFERRED)
+
+/* Exit value of a cancelled thread.  */
+#define PTH_CANCELED            ((void *)-1)
+
+/* Thread specific data.  */
+#define PTH_KEY_MAX            256
+#define PTH_KEY_INIT	       (-1)
 
 
 /* Event subject classes. */
@@ -111,6 +130,9 @@ enum
 #define PTH_EVENT_TID          (1<<8)
 #define PTH_EVENT_FUNC         (1<<9)
 #define PTH_EVENT_HANDLE       (1<<10)  /* A generic waitable W32 HANDLE. */
+#define PTH_EVENT_SEM          (1<<19)  /* A pth_sem_t; when the event
+                                           occurred the semaphore has
+                                           been decremented.  */
 
 /* Event occurrence restrictions. */
 #define PTH_UNTIL_OCCURRED     (1<<11)
@@ -167,6 +189,27 @@ enum
 #define PTH_CTRL_GETTHREADS_DEAD      (1<<9)
 #define PTH_CTRL_DUMPSTATE            (1<<10)
 
+/* W32 specific controls for pth_ctrl().  */
+#define PTH_CTRL_SETCOALESCE          (1<<16)  /* int: enable coalescing
+                                                  of small writes.  */
+#define PTH_CTRL_GETFDAVAIL           (1<<17)  /* int fd: bytes readable
+                                                  without blocking.  */
+#define PTH_CTRL_SETFDSTATS           (1<<18)  /* int: enable I/O
+                                                  statistics.  */
+#define PTH_CTRL_GETFDSTATS           (1<<19)  /* int fd, struct
+                                                  pth_fdstats_s *.  */
+#define PTH_CTRL_SETSTACKSIZE         (1<<20)  /* unsigned int: default
+                                                  stack reservation.  */
+#define PTH_CTRL_GETSTACKCOMMIT       (1<<21)  /* Committed stack bytes
+                                                  of all threads.  */
+#define PTH_CTRL_SETHELPERSTACK       (1<<22)  /* unsigned int: stack
+                                                  reservation of I/O
+                                                  helper threads.  */
+#define PTH_CTRL_GETHELPERTHREADS     (1<<23)  /* Number of I/O helper
+                                                  threads.  */
+#define PTH_CTRL_GETHELPERSTACK       (1<<24)  /* Stack bytes reserved
+                                                  by them.  */
+
 #define PTH_CTRL_GETTHREADS           (  PTH_CTRL_GETTHREADS_NEW       \
                                        | PTH_CTRL_GETTHREADS_READY     \
                                        | PTH_CTRL_GETTHREADS_RUNNING   \
@@ -175,6 +218,27 @@ enum
                                        | PTH_CTRL_GETTHREADS_DEAD        )
 
 
+/* I/O statistics of a descriptor as returned by
+   pth_ctrl (PTH_CTRL_GETFDSTATS, fd, &stats).  The counters wrap
+   around.  Statistics are kept for at most 128 descriptors at a time;
+   for other descriptors pth_ctrl returns -1 with ERRNO set to ENOENT.
+   On a listening socket READ_CALLS counts the accepted connections;
+   peeking counts as a read call without bytes.  */
+struct pth_fdstats_s
+{
+  unsigned long bytes_in;       /* Bytes read from the system.  */
+  unsigned long bytes_out;      /* Bytes written to the system.  */
+  unsigned long read_calls;     /* Read system calls.  */
+  unsigned long write_calls;    /* Write system calls.  */
+  unsigned long reader_stalls;  /* Times the reader thread found its
+                                   buffer full.  */
+  unsigned long read_waits;     /* Times a read found no buffered data.  */
+  unsigned long write_waits;    /* Times a write waited for the writer
+                                   thread.  */
+  unsigned long write_wait_ms;  /* Total time of these waits.  */
+};
+
+
 /* Event status codes. */
 typedef enum
   {
@@ -185,6 +249,18 @@ typedef enum
 pth_status_t;
 
 
+/* Thread states as returned for PTH_ATTR_STATE.  */
+typedef enum
+  {
+    PTH_STATE_SCHEDULER = 0,
+    PTH_STATE_NEW,
+    PTH_STATE_READY,
+    PTH_STATE_WAITING,
+    PTH_STATE_DEAD
+  }
+pth_state_t;
+
+
 /* Event deallocation types. */
 enum 
   {
@@ -203,6 +279,12 @@ typedef W32_PTH_HANDLE_INTERNAL pth_mutex_t;
 /* The read-write lock object.  */
 typedef W32_PTH_HANDLE_INTERNAL pth_rwlock_t;
 
+/* The counting semaphore object.  */
+typedef W32_PTH_HANDLE_INTERNAL pth_sem_t;
+
+/* The barrier object.  */
+typedef W32_PTH_HANDLE_INTERNAL pth_barrier_t;
+
 
 /* The Event object.  */
 struct pth_event_s;
@@ -218,10 +300,34 @@ typedef struct pth_attr_s *pth_attr_t;
 typedef int pth_key_t;
 
 
+/* The once control object.  */
+typedef int pth_once_t;
+#define PTH_ONCE_INIT  0
+
+
 /* The Pth time object.  */
 typedef struct timeval pth_time_t;
 
 
+/* The buffered stream object.  The first four fields are used by the
+   pth_stream_getc and pth_stream_putc macros; all fields are private
+   to the library and must not be changed by the application.  */
+struct pth_stream_s
+{
+  unsigned char *rptr;   /* Next byte to read.  */
+  unsigned char *rend;   /* End of the valid data in the read buffer.  */
+  unsigned char *wptr;   /* Next free byte in the write buffer.  */
+  unsigned char *wend;   /* End of the write buffer.  */
+  int fd;
+  int flags;
+  unsigned char *rbuf;
+  size_t rsize;
+  unsigned char *wbuf;
+  size_t wsize;
+};
+typedef struct pth_stream_s *pth_stream_t;
+
+
 /* Function prototypes. */
 int pth_init (void);
 int pth_kill (void);
@@ -229,8 +335,44 @@ long pth_ctrl (unsigned long query, ...);
 
 int pth_read_ev (int fd, void *buffer, size_t size, pth_event_t ev);
 int pth_read (int fd,  void *buffer, size_t size);
+int pth_read_until (int fd, void *buffer, size_t size, int delim);
+int pth_read_line (int fd, void *buffer, size_t size);
+/* Copy up to SIZE bytes available for FD to BUFFER without consuming
+   them.  pth_peek_ev blocks until at least MINSIZE bytes are available,
+   EOF or an error was seen, or EV occurred; pth_peek uses a MINSIZE
+   of 1.  For pipes waiting stops when the 4096 byte read buffer is
+   full; for sockets MINSIZE must not exceed the receive buffer.  */
+int pth_peek_ev (int fd, void *buffer, size_t size, size_t minsize,
+                 pth_event_t ev);
+int pth_peek (int fd, void *buffer, size_t size);
 int pth_write_ev (int fd, const void *buffer, size_t size, pth_event_t ev);
 int pth_write (int fd, const void *buffer, size_t size);
+int pth_splice_ev (int in_fd, int out_fd, size_t size, pth_event_t ev);
+int pth_splice (int in_fd, int out_fd, size_t size);
+int pth_flush (int fd);
+
+pth_stream_t pth_stream_new (int fd, size_t rsize, size_t wsize);
+int pth_stream_free (pth_stream_t st);
+int pth_stream_fd (pth_stream_t st);
+int pth_stream_read_ev (pth_stream_t st, void *buffer, size_t size,
+                        pth_event_t ev);
+int pth_stream_read (pth_stream_t st, void *buffer, size_t size);
+int pth_stream_write_ev (pth_stream_t st, const void *buffer, size_t size,
+                         pth_event_t ev);
+int pth_stream_write (pth_stream_t st, const void *buffer, size_t size);
+int pth_stream_flush_ev (pth_stream_t st, pth_event_t ev);
+int pth_stream_flush (pth_stream_t st);
+int pth_stream_eof (pth_stream_t st);
+int pth_stream_error (pth_stream_t st);
+int _pth_stream_fillbuf (pth_stream_t st);
+int _pth_stream_flsbuf (pth_stream_t st, int c);
+
+/* Fast byte access to a stream.  Both return -1 on EOF or error.  */
+#define pth_stream_getc(st)                                     \
+  ((st)->rptr < (st)->rend? *(st)->rptr++ : _pth_stream_fillbuf ((st)))
+#define pth_stream_putc(st,c)                                   \
+  ((st)->wptr < (st)->wend? (*(st)->wptr++ = (unsigned char)(c))  \
+   /*                   */: _pth_stream_flsbuf ((st), (c)))
 
 int pth_select (int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
 		const struct timeval *timeout);
@@ -240,8 +382,28 @@ int pth_select_ev (int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
 int pth_accept (int fd, struct sockaddr *addr, int *addrlen);
 int pth_accept_ev (int fd, struct sockaddr *addr, int *addrlen,
                    pth_event_t hd);
+int pth_accept_many (int fd, int *fds, int nfds,
+                     struct sockaddr *addr, int *addrlen, pth_event_t ev);
+int pth_accept_prepost (int fd, int count);
 
 int pth_connect (int fd, struct sockaddr *name, int namelen);
+int pth_connect_ev (int fd, struct sockaddr *name, int namelen,
+                    pth_event_t ev_extra);
+
+int pth_recv_ev (int fd, void *buffer, size_t size, int flags,
+                 pth_event_t ev);
+int pth_recv (int fd, void *buffer, size_t size, int flags);
+int pth_recvfrom_ev (int fd, void *buffer, size_t size, int flags,
+                     struct sockaddr *from, int *fromlen, pth_event_t ev);
+int pth_recvfrom (int fd, void *buffer, size_t size, int flags,
+                  struct sockaddr *from, int *fromlen);
+int pth_send_ev (int fd, const void *buffer, size_t size, int flags,
+                 pth_event_t ev);
+int pth_send (int fd, const void *buffer, size_t size, int flags);
+int pth_sendto_ev (int fd, const void *buffer, size_t size, int flags,
+                   const struct sockaddr *to, int tolen, pth_event_t ev);
+int pth_sendto (int fd, const void *buffer, size_t size, int flags,
+                const struct sockaddr *to, int tolen);
 
 
 int pth_mutex_release (pth_mutex_t *hd);
@@ -250,19 +412,47 @@ int pth_mutex_init (pth_mutex_t *hd);
 /* We need this under windows, otherwise we would leak handles.  */
 int pth_mutex_destroy (pth_mutex_t *hd);
 
+/* Waiting writers take precedence over new readers, except for a
+   thread which already holds a read lock on the same rwlock; thus
+   read locks may be taken recursively.  */
 int pth_rwlock_init (pth_rwlock_t *rwlock);
 int pth_rwlock_acquire (pth_rwlock_t *rwlock, int op, int try, pth_event_t ev);
 int pth_rwlock_release (pth_rwlock_t *rwlock);
 
+int pth_sem_init (pth_sem_t *sem, unsigned int value);
+int pth_sem_acquire (pth_sem_t *sem, int try_only, pth_event_t ev_extra);
+int pth_sem_release (pth_sem_t *sem, unsigned int count);
+int pth_sem_destroy (pth_sem_t *sem);
+
+int pth_barrier_init (pth_barrier_t *barrier, int threshold);
+int pth_barrier_reach (pth_barrier_t *barrier);
+int pth_barrier_destroy (pth_barrier_t *barrier);
+
+int pth_key_create (pth_key_t *key, void (*destructor)(void *));
+int pth_key_delete (pth_key_t key);
+int pth_key_setdata (pth_key_t key, const void *value);
+void *pth_key_getdata (pth_key_t key);
+
+int pth_once (pth_once_t *once, void (*constructor)(void *), void *arg);
+
 
 pth_attr_t pth_attr_new (void);
 int pth_attr_destroy (pth_attr_t hd);
 int pth_attr_set (pth_attr_t hd, int field, ...);
+int pth_attr_get (pth_attr_t hd, int field, ...);
+pth_attr_t pth_attr_of (pth_t tid);
 
 pth_t pth_spawn (pth_attr_t hd, void *(*func)(void *), void *arg);
+int pth_spawn_n (pth_attr_t hd, int count, void *(*func)(void *),
+                 void *const *args, pth_t *tids, int together);
 pth_t pth_self (void);
 int pth_join (pth_t hd, void **value);
+int pth_cancel (pth_t hd);
 int pth_abort (pth_t hd);
+int pth_cancel_state (int newstate, int *oldstate);
+void pth_cancel_point (void);
+int pth_cleanup_push (void (*func)(void *), void *arg);
+int pth_cleanup_pop (int execute);
 void pth_exit (void *value);
 
 unsigned int pth_waitpid (unsigned int, int *status, int options);
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <windows.h>
 
 #include <assert.h>
@@ -230,6 +231,7 @@ _pth_debug (int level, const char *format, ...)
 #define PIPEBUF_SIZE  4096
 #define MAX_READERS 40
 #define MAX_WRITERS 40
+#define MAX_FDSTATS 128
 
 
 
@@ -251,7 +253,13 @@ struct reader_context_s
   HANDLE have_data_ev;
   /* This is automatically reset.  */
   HANDLE have_space_ev;
+  /* This is manually reset by _pth_io_peek and set whenever data, EOF
+     or an error arrives.  */
+  HANDLE more_data_ev;
   HANDLE stopped;
+  int orphaned;         /* The thread shall release the context.  */
+  struct fdstats_s *stats;
+  unsigned int stack_size;  /* Stack reserved for the thread.  */
   size_t readpos, writepos;
   char buffer[READBUF_SIZE];
 };
@@ -283,11 +291,52 @@ struct writer_context_s
   HANDLE have_data;
   HANDLE is_empty;
   HANDLE stopped;
+  int orphaned;         /* The thread shall release the context.  */
+  struct fdstats_s *stats;
+  unsigned int stack_size;  /* Stack reserved for the thread.  */
   size_t nbytes; 
   char buffer[WRITEBUF_SIZE];
 };
 
 
+/* If set, small writes are appended to the buffer of a busy writer
+   thread instead of waiting for it to become empty.  */
+static int coalesce_writes;
+
+
+/* Per descriptor I/O counters.  Slots are allocated under the table
+   lock; the counters themselves are only updated with interlocked
+   operations.  A helper thread updates them only while holding the
+   lock of its context and the pointer is cleared under that lock
+   when the context is stopped; thus a slot can be reused by
+   drop_fdstats even if the thread is still running.  */
+struct fdstats_s
+{
+  int used;
+  int fd;
+  volatile LONG bytes_in;
+  volatile LONG bytes_out;
+  volatile LONG read_calls;
+  volatile LONG write_calls;
+  volatile LONG reader_stalls;
+  volatile LONG read_waits;
+  volatile LONG write_waits;
+  volatile LONG write_wait_ms;
+};
+
+static int fdstats_enabled;
+static struct fdstats_s fdstats_table[MAX_FDSTATS];
+DEFINE_STATIC_LOCK (fdstats_table_lock);
+
+#define STAT_ADD(st,field,n)                                    \
+  do                                                            \
+    {                                                           \
+      if ((st))                                                 \
+        InterlockedExchangeAdd ((LONG *)&(st)->field, (LONG)(n)); \
+    }                                                           \
+  while (0)
+
+
 static struct
 {
   volatile int used;
@@ -361,12 +410,278 @@ is_socket (HANDLE hd)
 }
 
 
+/* Return the statistics slot for FD or NULL if statistics are
+   disabled or all MAX_FDSTATS slots are in use.  */
+static struct fdstats_s *
+get_fdstats (int fd)
+{
+  struct fdstats_s *st = NULL;
+  int i, free_slot = -1;
+
+  if (!fdstats_enabled)
+    return NULL;
+
+  LOCK (fdstats_table_lock);
+  for (i = 0; i < MAX_FDSTATS; i++)
+    {
+      if (fdstats_table[i].used && fdstats_table[i].fd == fd)
+        {
+          st = fdstats_table + i;
+          break;
+        }
+      if (!fdstats_table[i].used && free_slot == -1)
+        free_slot = i;
+    }
+  if (!st && free_slot != -1)
+    {
+      st = fdstats_table + free_slot;
+      memset (st, 0, sizeof *st);
+      st->fd = fd;
+      st->used = 1;
+    }
+  UNLOCK (fdstats_table_lock);
+  return st;
+}
+
+
+static void
+drop_fdstats (int fd)
+{
+  int i;
+
+  LOCK (fdstats_table_lock);
+  for (i = 0; i < MAX_FDSTATS; i++)
+    if (fdstats_table[i].used && fdstats_table[i].fd == fd)
+      fdstats_table[i].used = 0;
+  UNLOCK (fdstats_table_lock);
+}
+
+
+/* Account a system call which transferred NBYTES on FD.  This is
+   used for descriptors which are not served by a helper thread.  */
+void
+_pth_io_account (int fd, int writing, int nbytes)
+{
+  struct fdstats_s *st;
+
+  if (!fdstats_enabled)
+    return;
+  st = get_fdstats (fd);
+  if (writing)
+    {
+      STAT_ADD (st, write_calls, 1);
+      if (nbytes > 0)
+        STAT_ADD (st, bytes_out, nbytes);
+    }
+  else
+    {
+      STAT_ADD (st, read_calls, 1);
+      if (nbytes > 0)
+        STAT_ADD (st, bytes_in, nbytes);
+    }
+}
+
+
+void
+_pth_io_set_fdstats (int enable)
+{
+  fdstats_enabled = !!enable;
+}
+
+
+/* Copy the counters of FD to VALUES in the order of struct
+   fdstats_s, that is bytes in, bytes out, read calls, write calls,
+   reader stalls, read waits, write waits and write wait time.
+   Returns -1 if nothing has been recorded for FD.  */
+int
+_pth_io_get_fdstats (int fd, unsigned long values[8])
+{
+  int i, rc = -1;
+
+  LOCK (fdstats_table_lock);
+  for (i = 0; i < MAX_FDSTATS; i++)
+    if (fdstats_table[i].used && fdstats_table[i].fd == fd)
+      {
+        struct fdstats_s *st = fdstats_table + i;
+
+        values[0] = st->bytes_in;
+        values[1] = st->bytes_out;
+        values[2] = st->read_calls;
+        values[3] = st->write_calls;
+        values[4] = st->reader_stalls;
+        values[5] = st->read_waits;
+        values[6] = st->write_waits;
+        values[7] = st->write_wait_ms;
+        rc = 0;
+        break;
+      }
+  UNLOCK (fdstats_table_lock);
+  if (rc)
+    set_errno (ENOENT);  /* Not tracked or the table was full.  */
+  return rc;
+}
+
+
+/* The helper threads only loop over a system call with a buffer
+   which is part of their context, thus a small stack suffices.  The
+   size is rounded up by the system to the allocation granularity.  */
+#define HELPER_STACK_SIZE (64*1024)
+
+#ifndef STACK_SIZE_PARAM_IS_A_RESERVATION
+# define STACK_SIZE_PARAM_IS_A_RESERVATION 0x00010000
+#endif
+
+/* Stack reservation for new helper threads; 0 selects the default of
+   the executable.  */
+static unsigned int helper_stack_size = HELPER_STACK_SIZE;
+
+/* Number of helper threads and the sum of their stack
+   reservations.  */
+static volatile LONG helper_count;
+static volatile LONG helper_stack_total;
+
+
+/* Start a helper thread running FNC with ARG.  The reserved stack
+   size is stored at R_STACK_SIZE.  */
+static HANDLE
+create_helper_thread (LPSECURITY_ATTRIBUTES sec_attr,
+                      LPTHREAD_START_ROUTINE fnc, void *arg,
+                      unsigned int *r_stack_size)
+{
+  HANDLE th;
+  DWORD tid;
+  unsigned int size = helper_stack_size;
+
+  th = CreateThread (sec_attr, size, fnc, arg,
+                     STACK_SIZE_PARAM_IS_A_RESERVATION, &tid);
+  if (th)
+    {
+      InterlockedIncrement (&helper_count);
+      InterlockedExchangeAdd (&helper_stack_total, (LONG)size);
+    }
+  *r_stack_size = size;
+  return th;
+}
+
+
+/* Account for the end of a helper thread with STACK_SIZE.  */
+static void
+helper_thread_gone (unsigned int stack_size)
+{
+  InterlockedDecrement (&helper_count);
+  InterlockedExchangeAdd (&helper_stack_total, -(LONG)stack_size);
+}
+
+
+/* Set the stack reservation for new helper threads to SIZE and
+   return the previous value.  */
+unsigned int
+_pth_io_set_helper_stack (unsigned int size)
+{
+  unsigned int old = helper_stack_size;
+
+  helper_stack_size = size;
+  return old;
+}
+
+
+/* Return the number of helper threads and store the sum of their
+   stack reservations at R_RESERVED.  Threads started with the
+   executable's default size are counted with 0 bytes.  */
+long
+_pth_io_get_helper_stats (long *r_reserved)
+{
+  if (r_reserved)
+    *r_reserved = helper_stack_total;
+  return helper_count;
+}
+
+
+/* Total time in milliseconds we wait for a helper thread to
+   terminate, and the slice after which the cancellation of its I/O
+   is repeated.  A writer may use half of the time to finish a write
+   in progress before it is cancelled.  */
+#define STOP_TIMEOUT 2000
+#define STOP_SLICE     50
+#define WRITER_GRACE (STOP_TIMEOUT / 2)
+
+#ifndef HAVE_W32CE_SYSTEM
+typedef BOOL (WINAPI *cancel_synchronous_io_t) (HANDLE);
+#endif
+
+/* Cancel a synchronous ReadFile or WriteFile the helper thread
+   THREAD_HD may be blocked in.  CancelSynchronousIo is only available
+   since Vista, thus we look it up at runtime.  */
+static void
+cancel_thread_io (HANDLE thread_hd)
+{
+#ifndef HAVE_W32CE_SYSTEM
+  static cancel_synchronous_io_t func;
+  static int initialized;
+
+  if (!initialized)
+    {
+      func = (cancel_synchronous_io_t)
+        GetProcAddress (GetModuleHandleA ("kernel32.dll"),
+                        "CancelSynchronousIo");
+      initialized = 1;
+    }
+  if (func)
+    func (thread_hd);
+#else
+  (void)thread_hd;
+#endif
+}
+
+
+/* Wait until the helper thread THREAD_HD has set STOPPED.  The thread
+   is given GRACE milliseconds to finish on its own, then its I/O is
+   cancelled.  Returns 0 if the thread stopped or -1 if it did not
+   stop within STOP_TIMEOUT, which includes GRACE.  */
+static int
+wait_helper_stopped (HANDLE stopped, HANDLE thread_hd, DWORD grace)
+{
+  DWORD waited;
+
+  if (WaitForSingleObject (stopped, grace) == WAIT_OBJECT_0)
+    return 0;
+  for (waited = grace; waited < STOP_TIMEOUT; waited += STOP_SLICE)
+    {
+      /* The thread may not yet have entered the system call, so we
+         cancel again for each slice.  */
+      cancel_thread_io (thread_hd);
+      if (WaitForSingleObject (stopped, STOP_SLICE) == WAIT_OBJECT_0)
+        return 0;
+    }
+  return -1;
+}
+
+
+static void
+release_reader (struct reader_context_s *ctx)
+{
+  if (ctx->stopped)
+    CloseHandle (ctx->stopped);
+  if (ctx->have_data_ev)
+    CloseHandle (ctx->have_data_ev);
+  if (ctx->have_space_ev)
+    CloseHandle (ctx->have_space_ev);
+  if (ctx->more_data_ev)
+    CloseHandle (ctx->more_data_ev);
+  CloseHandle (ctx->thread_hd);
+  helper_thread_gone (ctx->stack_size);
+  DESTROY_LOCK (ctx->mutex);
+  _pth_free (ctx);
+}
+
+
 static DWORD CALLBACK 
 reader (void *arg)
 {
   struct reader_context_s *ctx = arg;
   int nbytes;
   DWORD nread;
+  int orphaned;
   int sock;
   TRACE_BEG1 (DEBUG_SYSIO, "pth:reader", ctx->file_hd,
 	      "thread=%p", ctx->thread_hd);
@@ -381,6 +696,7 @@ reader (void *arg)
       if ((ctx->writepos + 1) % READBUF_SIZE == ctx->readpos)
 	{ 
 	  /* Wait for space.  */
+	  STAT_ADD (ctx->stats, reader_stalls, 1);
 	  if (!ResetEvent (ctx->have_space_ev))
 	    TRACE_LOG1 ("ResetEvent failed: ec=%d", (int) GetLastError ());
 	  UNLOCK (ctx->mutex);
@@ -466,6 +782,8 @@ reader (void *arg)
       TRACE_LOG1 ("got %u bytes", nread);
       
       LOCK (ctx->mutex);
+      STAT_ADD (ctx->stats, read_calls, 1);
+      STAT_ADD (ctx->stats, bytes_in, nread);
       if (ctx->stop_me)
 	{
 	  UNLOCK (ctx->mutex);
@@ -474,12 +792,22 @@ reader (void *arg)
       ctx->writepos = (ctx->writepos + nread) % READBUF_SIZE;
       if (!SetEvent (ctx->have_data_ev))
 	TRACE_LOG1 ("SetEvent failed: ec=%d", (int) GetLastError ());
+      SetEvent (ctx->more_data_ev);
       UNLOCK (ctx->mutex);
     }
   /* Indicate that we have an error or EOF.  */
   if (!SetEvent (ctx->have_data_ev))
     TRACE_LOG1 ("SetEvent failed: ec=%d", (int) GetLastError ());
+  LOCK (ctx->mutex);
+  SetEvent (ctx->more_data_ev);
   SetEvent (ctx->stopped);
+  orphaned = ctx->orphaned;
+  UNLOCK (ctx->mutex);
+  if (orphaned)
+    {
+      TRACE_LOG ("releasing orphaned context");
+      release_reader (ctx);
+    }
   
   return TRACE_SUC ();
 }
@@ -490,7 +818,6 @@ create_reader (HANDLE fd)
 {
   struct reader_context_s *ctx;
   SECURITY_ATTRIBUTES sec_attr;
-  DWORD tid;
 
   TRACE_BEG (DEBUG_SYSIO, "pth:create_reader", fd);
 
@@ -506,19 +833,25 @@ create_reader (HANDLE fd)
     }
 
   ctx->file_hd = fd;
+  ctx->stats = get_fdstats (handle_to_fd (fd));
   ctx->refcount = 1;
   ctx->have_data_ev = CreateEvent (&sec_attr, TRUE, FALSE, NULL);
   if (ctx->have_data_ev)
     ctx->have_space_ev = CreateEvent (&sec_attr, FALSE, TRUE, NULL);
   if (ctx->have_space_ev)
+    ctx->more_data_ev = CreateEvent (&sec_attr, TRUE, FALSE, NULL);
+  if (ctx->more_data_ev)
     ctx->stopped = CreateEvent (&sec_attr, TRUE, FALSE, NULL);
-  if (!ctx->have_data_ev || !ctx->have_space_ev || !ctx->stopped)
+  if (!ctx->have_data_ev || !ctx->have_space_ev || !ctx->more_data_ev
+      || !ctx->stopped)
     {
       TRACE_LOG1 ("CreateEvent failed: ec=%d", (int) GetLastError ());
       if (ctx->have_data_ev)
 	CloseHandle (ctx->have_data_ev);
       if (ctx->have_space_ev)
 	CloseHandle (ctx->have_space_ev);
+      if (ctx->more_data_ev)
+	CloseHandle (ctx->more_data_ev);
       if (ctx->stopped)
 	CloseHandle (ctx->stopped);
       _pth_free (ctx);
@@ -530,7 +863,8 @@ create_reader (HANDLE fd)
   ctx->have_data_ev = set_synchronize (ctx->have_data_ev);
   INIT_LOCK (ctx->mutex);
 
-  ctx->thread_hd = CreateThread (&sec_attr, 0, reader, ctx, 0, &tid);
+  ctx->thread_hd = create_helper_thread (&sec_attr, reader, ctx,
+                                         &ctx->stack_size);
   if (!ctx->thread_hd)
     {
       TRACE_LOG1 ("CreateThread failed: ec=%d", (int) GetLastError ());
@@ -539,6 +873,8 @@ create_reader (HANDLE fd)
 	CloseHandle (ctx->have_data_ev);
       if (ctx->have_space_ev)
 	CloseHandle (ctx->have_space_ev);
+      if (ctx->more_data_ev)
+	CloseHandle (ctx->more_data_ev);
       if (ctx->stopped)
 	CloseHandle (ctx->stopped);
       _pth_free (ctx);
@@ -558,36 +894,69 @@ create_reader (HANDLE fd)
 }
 
 
-static void
-destroy_reader (struct reader_context_s *ctx)
+/* Drop a reference to the reader context CTX and tell its thread to
+   stop if it was the last one.  Returns true if the caller needs to
+   finish the context with finish_reader.  */
+static int
+stop_reader (struct reader_context_s *ctx)
 {
   LOCK (ctx->mutex);
   ctx->refcount--;
   if (ctx->refcount != 0)
     {
       UNLOCK (ctx->mutex);
-      return;
+      return 0;
     }
   ctx->stop_me = 1;
+  ctx->stats = NULL;  /* The slot is dropped by the caller.  */
   if (ctx->have_space_ev) 
     SetEvent (ctx->have_space_ev);
   UNLOCK (ctx->mutex);
+  return 1;
+}
 
-  TRACE1 (DEBUG_SYSIO, "pth:destroy_reader", ctx->file_hd,
-	  "waiting for termination of thread %p", ctx->thread_hd);
-  WaitForSingleObject (ctx->stopped, INFINITE);
+
+/* Release the stopped reader context CTX if its thread has
+   terminated or leave that to the thread otherwise.  */
+static void
+reap_reader (struct reader_context_s *ctx)
+{
+  LOCK (ctx->mutex);
+  if (WaitForSingleObject (ctx->stopped, 0) != WAIT_OBJECT_0)
+    {
+      /* The thread is still blocked; it releases the context
+         itself when it eventually returns.  */
+      ctx->orphaned = 1;
+      UNLOCK (ctx->mutex);
+      TRACE1 (DEBUG_SYSIO, "pth:destroy_reader", ctx->file_hd,
+              "thread %p did not terminate - orphaned", ctx->thread_hd);
+      return;
+    }
+  UNLOCK (ctx->mutex);
   TRACE1 (DEBUG_SYSIO, "pth:destroy_reader", ctx->file_hd,
 	  "thread %p has terminated", ctx->thread_hd);
     
-  if (ctx->stopped)
-    CloseHandle (ctx->stopped);
-  if (ctx->have_data_ev)
-    CloseHandle (ctx->have_data_ev);
-  if (ctx->have_space_ev)
-    CloseHandle (ctx->have_space_ev);
-  CloseHandle (ctx->thread_hd);
-  DESTROY_LOCK (ctx->mutex);
-  _pth_free (ctx);
+  release_reader (ctx);
+}
+
+
+/* Wait for the thread of the stopped reader context CTX and release
+   the context.  */
+static void
+finish_reader (struct reader_context_s *ctx)
+{
+  TRACE1 (DEBUG_SYSIO, "pth:destroy_reader", ctx->file_hd,
+	  "waiting for termination of thread %p", ctx->thread_hd);
+  wait_helper_stopped (ctx->stopped, ctx->thread_hd, STOP_SLICE);
+  reap_reader (ctx);
+}
+
+
+static void
+destroy_reader (struct reader_context_s *ctx)
+{
+  if (stop_reader (ctx))
+    finish_reader (ctx);
 }
 
 
@@ -627,9 +996,11 @@ find_reader (int fd, int start_it)
 }
 
 
-static void
-kill_reader (int fd)
+/* Remove the reader context of FD from the table and return it.  */
+static struct reader_context_s *
+detach_reader (int fd)
 {
+  struct reader_context_s *ctx = NULL;
   int i;
 
   LOCK (reader_table_lock);
@@ -637,30 +1008,38 @@ kill_reader (int fd)
     {
       if (reader_table[i].used && reader_table[i].fd == fd)
 	{
-	  destroy_reader (reader_table[i].context);
+	  ctx = reader_table[i].context;
 	  reader_table[i].context = NULL;
 	  reader_table[i].used = 0;
 	  break;
 	}
     }
   UNLOCK (reader_table_lock);
+  return ctx;
 }
 
 
-int
-_pth_io_read (int fd, void *buffer, size_t count)
+static void
+kill_reader (int fd)
 {
-  int nread;
   struct reader_context_s *ctx;
-  TRACE_BEG2 (DEBUG_SYSIO, "_pth_io_read", fd,
-	      "buffer=%p, count=%u", buffer, count);
-  
-  ctx = find_reader (fd, 0);
-  if (!ctx)
-    {
-      set_errno (EBADF);
-      return TRACE_SYSRES (-1);
-    }
+
+  /* Do not hold the table lock while waiting for the thread.  */
+  ctx = detach_reader (fd);
+  if (ctx)
+    destroy_reader (ctx);
+}
+
+
+/* Wait until the reader context CTX has data available.  On success
+   1 is returned and the context is locked.  On EOF 0 is returned, on
+   error -1 with ERRNO set; in both cases the context is not locked.
+   _pth_io_read et al. use this so that they share the EOF logic.  */
+static int
+reader_wait_data (struct reader_context_s *ctx)
+{
+  TRACE_BEG (DEBUG_SYSIO, "pth:reader_wait_data", ctx->file_hd);
+
   if (ctx->eof_shortcut)
     return TRACE_SYSRES (0);
 
@@ -669,6 +1048,7 @@ _pth_io_read (int fd, void *buffer, size_t count)
     {
       /* No data available.  */
       UNLOCK (ctx->mutex);
+      STAT_ADD (ctx->stats, read_waits, 1);
       TRACE_LOG1 ("waiting for data from thread %p", ctx->thread_hd);
       WaitForSingleObject (ctx->have_data_ev, INFINITE);
       TRACE_LOG1 ("data from thread %p available", ctx->thread_hd);
@@ -689,13 +1069,21 @@ _pth_io_read (int fd, void *buffer, size_t count)
       set_errno (ctx->error_code);
       return TRACE_SYSRES (-1);
     }
-  
-  nread = ctx->readpos < ctx->writepos
-    ? ctx->writepos - ctx->readpos
-    : READBUF_SIZE - ctx->readpos;
-  if (nread > count)
-    nread = count;
-  memcpy (buffer, ctx->buffer + ctx->readpos, nread);
+
+  TRACE_SUC ();
+  return 1;
+}
+
+
+/* Mark NREAD bytes of the locked reader context CTX as consumed and
+   wake up the reader thread.  The context is unlocked on return.
+   Returns 0 on success or -1 with ERRNO set.  */
+static int
+reader_consume (struct reader_context_s *ctx, size_t nread)
+{
+  TRACE_BEG1 (DEBUG_SYSIO, "pth:reader_consume", ctx->file_hd,
+	      "nread=%u", nread);
+
   ctx->readpos = (ctx->readpos + nread) % READBUF_SIZE;
   if (ctx->readpos == ctx->writepos && !ctx->eof)
     {
@@ -717,6 +1105,47 @@ _pth_io_read (int fd, void *buffer, size_t count)
       return TRACE_SYSRES (-1);
     }
   UNLOCK (ctx->mutex);
+  return TRACE_SYSRES (0);
+}
+
+
+/* Return the number of bytes which may be taken in one go from the
+   locked reader context CTX.  */
+static size_t
+reader_contiguous (struct reader_context_s *ctx)
+{
+  return ctx->readpos < ctx->writepos
+    ? ctx->writepos - ctx->readpos
+    : READBUF_SIZE - ctx->readpos;
+}
+
+
+int
+_pth_io_read (int fd, void *buffer, size_t count)
+{
+  int nread;
+  int rc;
+  struct reader_context_s *ctx;
+  TRACE_BEG2 (DEBUG_SYSIO, "_pth_io_read", fd,
+	      "buffer=%p, count=%u", buffer, count);
+  
+  ctx = find_reader (fd, 0);
+  if (!ctx)
+    {
+      set_errno (EBADF);
+      return TRACE_SYSRES (-1);
+    }
+
+  rc = reader_wait_data (ctx);
+  if (rc <= 0)
+    return TRACE_SYSRES (rc);
+  
+  nread = reader_contiguous (ctx);
+  if (nread > count)
+    nread = count;
+  memcpy (buffer, ctx->buffer + ctx->readpos, nread);
+  if (reader_consume (ctx, nread))
+    return TRACE_SYSRES (-1);
   
 #if 0
   TRACE_LOGBUF (buffer, nread);
@@ -725,23 +1154,168 @@ _pth_io_read (int fd, void *buffer, size_t count)
 }
 
 
-/* The writer does use a simple buffering strategy so that we are
-   informed about write errors as soon as possible (i. e. with the the
-   next call to the write function.  */
-static DWORD CALLBACK 
-writer (void *arg)
+/* Read from FD into BUFFER until the byte DELIM has been stored or
+   COUNT bytes have been read.  The data is scanned in the reader's
+   ring buffer so that nothing after the delimiter is consumed.
+   Returns the number of bytes stored, 0 on EOF or -1 on error; if
+   EOF or an error occurs after some data has been stored, that data
+   is returned.  */
+int
+_pth_io_read_until (int fd, void *buffer, size_t count, int delim)
 {
-  struct writer_context_s *ctx = arg;
-  DWORD nwritten;
-  int sock;
-  TRACE_BEG1 (DEBUG_SYSIO, "pth:writer", ctx->file_hd,
-	      "thread=%p", ctx->thread_hd);
+  struct reader_context_s *ctx;
+  char *p = buffer;
+  const char *s, *d;
+  size_t total = 0, n;
+  int rc;
+  TRACE_BEG2 (DEBUG_SYSIO, "_pth_io_read_until", fd,
+	      "count=%u, delim=%d", count, delim);
 
-  sock = is_socket (ctx->file_hd);
+  ctx = find_reader (fd, 0);
+  if (!ctx)
+    {
+      set_errno (EBADF);
+      return TRACE_SYSRES (-1);
+    }
 
-  for (;;)
+  while (total < count)
     {
-      LOCK (ctx->mutex);
+      rc = reader_wait_data (ctx);
+      if (rc <= 0)
+        {
+          if (total)
+            break;
+          return TRACE_SYSRES (rc);
+        }
+
+      n = reader_contiguous (ctx);
+      if (n > count - total)
+        n = count - total;
+      s = ctx->buffer + ctx->readpos;
+      d = memchr (s, delim, n);
+      if (d)
+        n = d - s + 1;
+      memcpy (p + total, s, n);
+      total += n;
+      if (reader_consume (ctx, n))
+        return TRACE_SYSRES (-1);
+      if (d)
+        break;
+    }
+
+  return TRACE_SYSRES ((int)total);
+}
+
+
+/* Copy up to COUNT bytes which are available for FD to BUFFER without
+   consuming them.  Waits until at least one byte is available.  If
+   less than MINCOUNT bytes are available and more may arrive, -1 is
+   returned with ERRNO set to EAGAIN; the caller may then wait for
+   the event returned by _pth_get_reader_more_ev.  A full buffer
+   counts as enough.  Returns the number of bytes copied, 0 on EOF or
+   -1 on error.  */
+int
+_pth_io_peek (int fd, void *buffer, size_t count, size_t mincount)
+{
+  struct reader_context_s *ctx;
+  size_t n, n2, avail;
+  int rc;
+  TRACE_BEG1 (DEBUG_SYSIO, "_pth_io_peek", fd, "count=%u", count);
+
+  ctx = find_reader (fd, 0);
+  if (!ctx)
+    {
+      set_errno (EBADF);
+      return TRACE_SYSRES (-1);
+    }
+
+  rc = reader_wait_data (ctx);
+  if (rc <= 0)
+    return TRACE_SYSRES (rc);
+
+  avail = (ctx->writepos + READBUF_SIZE - ctx->readpos) % READBUF_SIZE;
+  if (avail < mincount && avail < READBUF_SIZE - 1
+      && !ctx->eof && !ctx->error)
+    {
+      /* The reader thread sets the event under the lock.  */
+      ResetEvent (ctx->more_data_ev);
+      UNLOCK (ctx->mutex);
+      set_errno (EAGAIN);
+      return TRACE_SYSRES (-1);
+    }
+
+  n = reader_contiguous (ctx);
+  if (n > count)
+    n = count;
+  memcpy (buffer, ctx->buffer + ctx->readpos, n);
+  if (n < count && ctx->writepos < ctx->readpos)
+    {
+      /* The data wraps around; take the rest from the start.  */
+      n2 = ctx->writepos;
+      if (n2 > count - n)
+        n2 = count - n;
+      memcpy ((char *)buffer + n, ctx->buffer, n2);
+      n += n2;
+    }
+  UNLOCK (ctx->mutex);
+  return TRACE_SYSRES ((int)n);
+}
+
+
+/* Return the number of bytes buffered for FD or -1 if FD has no
+   reader.  */
+int
+_pth_io_avail (int fd)
+{
+  struct reader_context_s *ctx;
+  int n;
+
+  ctx = find_reader (fd, 0);
+  if (!ctx)
+    return -1;
+
+  LOCK (ctx->mutex);
+  n = (ctx->writepos + READBUF_SIZE - ctx->readpos) % READBUF_SIZE;
+  UNLOCK (ctx->mutex);
+  return n;
+}
+
+
+static void
+release_writer (struct writer_context_s *ctx)
+{
+  if (ctx->stopped)
+    CloseHandle (ctx->stopped);
+  if (ctx->have_data)
+    CloseHandle (ctx->have_data);
+  if (ctx->is_empty)
+    CloseHandle (ctx->is_empty);
+  CloseHandle (ctx->thread_hd);
+  helper_thread_gone (ctx->stack_size);
+  DESTROY_LOCK (ctx->mutex);
+  _pth_free (ctx);
+}
+
+
+/* The writer does use a simple buffering strategy so that we are
+   informed about write errors as soon as possible (i. e. with the the
+   next call to the write function.  */
+static DWORD CALLBACK 
+writer (void *arg)
+{
+  struct writer_context_s *ctx = arg;
+  DWORD nwritten;
+  size_t nbytes;
+  int orphaned;
+  int sock;
+  TRACE_BEG1 (DEBUG_SYSIO, "pth:writer", ctx->file_hd,
+	      "thread=%p", ctx->thread_hd);
+
+  sock = is_socket (ctx->file_hd);
+
+  for (;;)
+    {
+      LOCK (ctx->mutex);
       if (ctx->stop_me)
 	{
 	  UNLOCK (ctx->mutex);
@@ -764,11 +1338,14 @@ writer (void *arg)
 	  UNLOCK (ctx->mutex);
 	  break;
         }
+      /* Take a snapshot of the length; _pth_io_write may append more
+         data while we are writing.  */
+      nbytes = ctx->nbytes;
       UNLOCK (ctx->mutex);
       
-      TRACE_LOG2 ("%s %d bytes", sock?"sending":"writing", ctx->nbytes);
+      TRACE_LOG2 ("%s %d bytes", sock?"sending":"writing", (int)nbytes);
  
-      /* Note that CTX->nbytes is not zero at this point, because
+      /* Note that NBYTES is not zero at this point, because
 	 _pth_io_write always writes at least 1 byte before waking
 	 us up, unless CTX->stop_me is true, which we catch above.  */
       if (sock)
@@ -778,7 +1355,7 @@ writer (void *arg)
           int n;
           
           n = send ((int)ctx->file_hd,
-                    ctx->buffer, ctx->nbytes, 0);
+                    ctx->buffer, nbytes, 0);
           if (n < 0)
             {
               ctx->error_code = (int) WSAGetLastError ();
@@ -791,7 +1368,7 @@ writer (void *arg)
       else
         {
           if (!WriteFile (ctx->file_hd, ctx->buffer,
-                          ctx->nbytes, &nwritten, NULL))
+                          nbytes, &nwritten, NULL))
             {
               ctx->error_code = (int) GetLastError ();
 #ifdef HAVE_W32CE_SYSTEM
@@ -816,13 +1393,27 @@ writer (void *arg)
       TRACE_LOG1 ("wrote %d bytes", (int) nwritten);
       
       LOCK (ctx->mutex);
+      STAT_ADD (ctx->stats, write_calls, 1);
+      STAT_ADD (ctx->stats, bytes_out, nwritten);
       ctx->nbytes -= nwritten;
+      /* Move what is left, including data appended in the meantime,
+         to the start of the buffer.  */
+      if (ctx->nbytes)
+        memmove (ctx->buffer, ctx->buffer + nwritten, ctx->nbytes);
       UNLOCK (ctx->mutex);
     }
   /* Indicate that we have an error.  */
   if (!SetEvent (ctx->is_empty))
     TRACE_LOG1 ("SetEvent failed: ec=%d", (int) GetLastError ());
+  LOCK (ctx->mutex);
   SetEvent (ctx->stopped);
+  orphaned = ctx->orphaned;
+  UNLOCK (ctx->mutex);
+  if (orphaned)
+    {
+      TRACE_LOG ("releasing orphaned context");
+      release_writer (ctx);
+    }
 
   return TRACE_SUC ();
 }
@@ -833,7 +1424,6 @@ create_writer (HANDLE fd)
 {
   struct writer_context_s *ctx;
   SECURITY_ATTRIBUTES sec_attr;
-  DWORD tid;
 
   TRACE_BEG (DEBUG_SYSIO, "pth:create_writer", fd);
 
@@ -849,6 +1439,7 @@ create_writer (HANDLE fd)
     }
   
   ctx->file_hd = fd;
+  ctx->stats = get_fdstats (handle_to_fd (fd));
   ctx->refcount = 1;
   ctx->have_data = CreateEvent (&sec_attr, TRUE, FALSE, NULL);
   if (ctx->have_data)
@@ -873,7 +1464,8 @@ create_writer (HANDLE fd)
   ctx->is_empty = set_synchronize (ctx->is_empty);
   INIT_LOCK (ctx->mutex);
 
-  ctx->thread_hd = CreateThread (&sec_attr, 0, writer, ctx, 0, &tid );
+  ctx->thread_hd = create_helper_thread (&sec_attr, writer, ctx,
+                                         &ctx->stack_size);
   if (!ctx->thread_hd)
     {
       TRACE_LOG1 ("CreateThread failed: ec=%d", (int) GetLastError ());
@@ -900,36 +1492,69 @@ create_writer (HANDLE fd)
   return ctx;
 }
 
-static void
-destroy_writer (struct writer_context_s *ctx)
+/* Drop a reference to the writer context CTX and tell its thread to
+   stop if it was the last one.  Returns true if the caller needs to
+   finish the context with finish_writer.  */
+static int
+stop_writer (struct writer_context_s *ctx)
 {
   LOCK (ctx->mutex);
   ctx->refcount--;
   if (ctx->refcount != 0)
     {
       UNLOCK (ctx->mutex);
-      return;
+      return 0;
     }
   ctx->stop_me = 1;
+  ctx->stats = NULL;  /* The slot is dropped by the caller.  */
   if (ctx->have_data) 
     SetEvent (ctx->have_data);
   UNLOCK (ctx->mutex);
-  
-  TRACE1 (DEBUG_SYSIO, "pth:destroy_writer", ctx->file_hd,
-	  "waiting for termination of thread %p", ctx->thread_hd);
-  WaitForSingleObject (ctx->stopped, INFINITE);
+  return 1;
+}
+
+
+/* Release the stopped writer context CTX if its thread has
+   terminated or leave that to the thread otherwise.  */
+static void
+reap_writer (struct writer_context_s *ctx)
+{
+  LOCK (ctx->mutex);
+  if (WaitForSingleObject (ctx->stopped, 0) != WAIT_OBJECT_0)
+    {
+      ctx->orphaned = 1;
+      UNLOCK (ctx->mutex);
+      TRACE1 (DEBUG_SYSIO, "pth:destroy_writer", ctx->file_hd,
+              "thread %p did not terminate - orphaned", ctx->thread_hd);
+      return;
+    }
+  UNLOCK (ctx->mutex);
   TRACE1 (DEBUG_SYSIO, "pth:destroy_writer", ctx->file_hd,
 	  "thread %p has terminated", ctx->thread_hd);
   
-  if (ctx->stopped)
-    CloseHandle (ctx->stopped);
-  if (ctx->have_data)
-    CloseHandle (ctx->have_data);
-  if (ctx->is_empty)
-    CloseHandle (ctx->is_empty);
-  CloseHandle (ctx->thread_hd);
-  DESTROY_LOCK (ctx->mutex);
-  _pth_free (ctx);
+  release_writer (ctx);
+}
+
+
+/* Wait for the thread of the stopped writer context CTX and release
+   the context.  */
+static void
+finish_writer (struct writer_context_s *ctx)
+{
+  TRACE1 (DEBUG_SYSIO, "pth:destroy_writer", ctx->file_hd,
+	  "waiting for termination of thread %p", ctx->thread_hd);
+  /* A write in progress is given some time to complete before it is
+     cancelled.  */
+  wait_helper_stopped (ctx->stopped, ctx->thread_hd, WRITER_GRACE);
+  reap_writer (ctx);
+}
+
+
+static void
+destroy_writer (struct writer_context_s *ctx)
+{
+  if (stop_writer (ctx))
+    finish_writer (ctx);
 }
 
 
@@ -969,9 +1594,11 @@ find_writer (int fd, int start_it)
 }
 
 
-static void
-kill_writer (int fd)
+/* Remove the writer context of FD from the table and return it.  */
+static struct writer_context_s *
+detach_writer (int fd)
 {
+  struct writer_context_s *ctx = NULL;
   int i;
 
   LOCK (writer_table_lock);
@@ -979,32 +1606,37 @@ kill_writer (int fd)
     {
       if (writer_table[i].used && writer_table[i].fd == fd)
 	{
-	  destroy_writer (writer_table[i].context);
+	  ctx = writer_table[i].context;
 	  writer_table[i].context = NULL;
 	  writer_table[i].used = 0;
 	  break;
 	}
     }
   UNLOCK (writer_table_lock);
+  return ctx;
 }
 
 
-int
-_pth_io_write (int fd, const void *buffer, size_t count)
+static void
+kill_writer (int fd)
 {
   struct writer_context_s *ctx;
-  TRACE_BEG2 (DEBUG_SYSIO, "_pth_io_write", fd,
-	      "buffer=%p, count=%u", buffer, count);
-#if 0
-  TRACE_LOGBUF (buffer, count);
-#endif
 
-  if (count == 0)
-    return TRACE_SYSRES (0);
+  /* Do not hold the table lock while waiting for the thread.  */
+  ctx = detach_writer (fd);
+  if (ctx)
+    destroy_writer (ctx);
+}
 
-  ctx = find_writer (fd, 0);
-  if (!ctx)
-    return TRACE_SYSRES (-1);
+
+/* Wait until the writer context CTX has an empty buffer.  On success
+   0 is returned and the context is locked.  On error -1 is returned
+   with ERRNO set and the context is not locked.  */
+static int
+writer_wait_empty (struct writer_context_s *ctx)
+{
+  DWORD t0;
+  TRACE_BEG (DEBUG_SYSIO, "pth:writer_wait_empty", ctx->file_hd);
 
   LOCK (ctx->mutex);
   if (!ctx->error && ctx->nbytes)
@@ -1022,7 +1654,10 @@ _pth_io_write (int fd, const void *buffer, size_t count)
 	}
       UNLOCK (ctx->mutex);
       TRACE_LOG1 ("waiting for empty buffer in thread %p", ctx->thread_hd);
+      t0 = GetTickCount ();
       WaitForSingleObject (ctx->is_empty, INFINITE);
+      STAT_ADD (ctx->stats, write_waits, 1);
+      STAT_ADD (ctx->stats, write_wait_ms, GetTickCount () - t0);
       TRACE_LOG1 ("thread %p buffer is empty", ctx->thread_hd);
       LOCK (ctx->mutex);
     }
@@ -1037,14 +1672,20 @@ _pth_io_write (int fd, const void *buffer, size_t count)
       return TRACE_SYSRES (-1);
     }
 
-  /* If no error occured, the number of bytes in the buffer must be
-     zero.  */
-  assert (!ctx->nbytes);
+  return TRACE_SYSRES (0);
+}
 
-  if (count > WRITEBUF_SIZE)
-    count = WRITEBUF_SIZE;
-  memcpy (ctx->buffer, buffer, count);
-  ctx->nbytes = count;
+
+/* Hand the NBYTES bytes now stored in the buffer of the locked writer
+   context CTX over to the writer thread.  The context is unlocked on
+   return.  Returns 0 on success or -1 with ERRNO set.  */
+static int
+writer_kick (struct writer_context_s *ctx, size_t nbytes)
+{
+  TRACE_BEG1 (DEBUG_SYSIO, "pth:writer_kick", ctx->file_hd,
+	      "nbytes=%u", nbytes);
+
+  ctx->nbytes = nbytes;
 
   /* We have to reset the is_empty event early, because it is also
      used by the select() implementation to probe the channel.  */
@@ -1065,11 +1706,216 @@ _pth_io_write (int fd, const void *buffer, size_t count)
       return TRACE_SYSRES (-1);
     }
   UNLOCK (ctx->mutex);
+  return TRACE_SYSRES (0);
+}
+
+
+int
+_pth_io_write (int fd, const void *buffer, size_t count)
+{
+  struct writer_context_s *ctx;
+  TRACE_BEG2 (DEBUG_SYSIO, "_pth_io_write", fd,
+	      "buffer=%p, count=%u", buffer, count);
+#if 0
+  TRACE_LOGBUF (buffer, count);
+#endif
+
+  if (count == 0)
+    return TRACE_SYSRES (0);
+
+  ctx = find_writer (fd, 0);
+  if (!ctx)
+    return TRACE_SYSRES (-1);
+
+  if (coalesce_writes)
+    {
+      LOCK (ctx->mutex);
+      if (!ctx->error && ctx->nbytes
+          && count <= WRITEBUF_SIZE - ctx->nbytes)
+        {
+          /* The writer thread is busy and will pick up the new data
+             with its next system call.  */
+          memcpy (ctx->buffer + ctx->nbytes, buffer, count);
+          ctx->nbytes += count;
+          UNLOCK (ctx->mutex);
+          TRACE_LOG1 ("appended to %u pending bytes", ctx->nbytes - count);
+          return TRACE_SYSRES ((int) count);
+        }
+      UNLOCK (ctx->mutex);
+    }
+
+  if (writer_wait_empty (ctx))
+    return TRACE_SYSRES (-1);
+
+  /* If no error occured, the number of bytes in the buffer must be
+     zero.  */
+  assert (!ctx->nbytes);
+
+  if (count > WRITEBUF_SIZE)
+    count = WRITEBUF_SIZE;
+  memcpy (ctx->buffer, buffer, count);
+  if (writer_kick (ctx, count))
+    return TRACE_SYSRES (-1);
 
   return TRACE_SYSRES ((int) count);
 }
 
 
+/* Wait until all data written to FD has been passed to the system.
+   Returns 0 on success or -1 with ERRNO set if a write failed.  */
+int
+_pth_io_flush (int fd)
+{
+  struct writer_context_s *ctx;
+  TRACE_BEG (DEBUG_SYSIO, "_pth_io_flush", fd);
+
+  ctx = find_writer (fd, 0);
+  if (!ctx)
+    return TRACE_SYSRES (0);  /* Nothing is buffered for FD.  */
+
+  if (writer_wait_empty (ctx))
+    return TRACE_SYSRES (-1);
+  UNLOCK (ctx->mutex);
+  return TRACE_SYSRES (0);
+}
+
+
+/* Enable or disable write coalescing for all writer threads.  */
+void
+_pth_io_set_coalesce (int enable)
+{
+  coalesce_writes = !!enable;
+}
+
+
+/* Move up to COUNT bytes from the reader context of IN_FD to OUT_FD.
+   The data is taken directly from the reader's ring buffer: If OUT_FD
+   has a writer context the bytes are copied straight into the
+   writer's buffer, otherwise they are sent or written from the ring
+   buffer.  Thus the data never shows up in a user buffer.  The reader
+   context is kept locked until the bytes have been consumed so that
+   concurrent readers of IN_FD can't take the same bytes.  Returns the
+   number of bytes moved, 0 on EOF or -1 on error.  */
+int
+_pth_io_splice (int in_fd, int out_fd, size_t count)
+{
+  struct reader_context_s *rctx;
+  struct writer_context_s *wctx;
+  const char *data;
+  size_t nbytes;
+  int rc;
+  TRACE_BEG2 (DEBUG_SYSIO, "_pth_io_splice", in_fd,
+	      "out_fd=0x%x, count=%u", out_fd, count);
+
+  if (count == 0)
+    return TRACE_SYSRES (0);
+
+  rctx = find_reader (in_fd, 0);
+  if (!rctx)
+    {
+      set_errno (EBADF);
+      return TRACE_SYSRES (-1);
+    }
+  wctx = find_writer (out_fd, 0);
+
+  /* Wait for room in the writer before locking the reader so that a
+     slow OUT_FD does not hold up the reader thread or other users of
+     IN_FD.  Another thread may have filled the writer meanwhile, thus
+     check again with both locked.  */
+  for (;;)
+    {
+      if (wctx)
+	{
+	  if (writer_wait_empty (wctx))
+	    return TRACE_SYSRES (-1);
+	  UNLOCK (wctx->mutex);
+	}
+      rc = reader_wait_data (rctx);
+      if (rc <= 0)
+	return TRACE_SYSRES (rc);
+      if (!wctx)
+	break;
+      LOCK (wctx->mutex);
+      if (!wctx->nbytes && !wctx->error)
+	break;
+      UNLOCK (wctx->mutex);
+      UNLOCK (rctx->mutex);
+    }
+  nbytes = reader_contiguous (rctx);
+  if (nbytes > count)
+    nbytes = count;
+  data = rctx->buffer + rctx->readpos;
+
+  /* The reader thread only appends at WRITEPOS and takes the lock
+     just briefly; keeping it here merely stalls the thread once its
+     buffer is full.  A direct send or write below however keeps the
+     lock for as long as OUT_FD blocks, and so does a pth_close of
+     IN_FD.  */
+  if (wctx)
+    {
+      assert (!wctx->nbytes);
+      if (nbytes > WRITEBUF_SIZE)
+	nbytes = WRITEBUF_SIZE;
+      memcpy (wctx->buffer, data, nbytes);
+      if (writer_kick (wctx, nbytes))
+	{
+	  UNLOCK (rctx->mutex);
+	  return TRACE_SYSRES (-1);
+	}
+    }
+  else if (is_socket (fd_to_handle (out_fd)))
+    {
+      fd_set wfds;
+      int n, ec = 0;
+
+      while ((n = send (out_fd, data, nbytes, 0)) < 0
+             && (ec = (int) WSAGetLastError ()) == WSAEWOULDBLOCK)
+	{
+	  /* A non-blocking socket; wait until it is writable.  */
+	  FD_ZERO (&wfds);
+	  FD_SET (out_fd, &wfds);
+	  if (select (0, NULL, &wfds, NULL, NULL) < 0)
+	    {
+	      ec = (int) WSAGetLastError ();
+	      break;
+	    }
+	}
+      _pth_io_account (out_fd, 1, n);
+      if (n < 0)
+	{
+	  TRACE_LOG1 ("send error: ec=%d", ec);
+	  UNLOCK (rctx->mutex);
+	  set_errno (map_wsa_to_errno (ec));
+	  return TRACE_SYSRES (-1);
+	}
+      nbytes = n;
+    }
+  else
+    {
+      DWORD nwritten;
+
+      if (!WriteFile (fd_to_handle (out_fd), data,
+		      nbytes, &nwritten, NULL))
+	{
+	  int ec = (int) GetLastError ();
+
+	  _pth_io_account (out_fd, 1, -1);
+	  TRACE_LOG1 ("write error: ec=%d", ec);
+	  UNLOCK (rctx->mutex);
+	  set_errno (ec == ERROR_NO_DATA? EPIPE : EIO);
+	  return TRACE_SYSRES (-1);
+	}
+      nbytes = nwritten;
+      _pth_io_account (out_fd, 1, (int) nbytes);
+    }
+
+  if (reader_consume (rctx, nbytes))
+    return TRACE_SYSRES (-1);
+
+  return TRACE_SYSRES ((int) nbytes);
+}
+
+
 /* WindowsCE does not provide a pipe feature.  However we need
    something like a pipe to convey data between processes and in some
    cases within a process.  This replacement is not only used by
@@ -1229,6 +2075,7 @@ pth_close (int fd)
 
   kill_reader (fd);
   kill_writer (fd);
+  drop_fdstats (fd);
 
   if (!CloseHandle (fd_to_handle (fd)))
     { 
@@ -1242,6 +2089,196 @@ pth_close (int fd)
 }
 
 
+/* Descriptors queued for the reaper thread by pth_close_async.  The
+   helper threads have already been told to stop; the reaper waits
+   for them and closes the handle.  */
+struct close_job_s
+{
+  struct close_job_s *next;
+  int fd;
+  struct reader_context_s *reader;
+  struct writer_context_s *writer;
+};
+
+static struct close_job_s *reaper_queue;
+static struct close_job_s **reaper_tail = &reaper_queue;
+static HANDLE reaper_ev;
+static HANDLE reaper_thread;
+static unsigned int reaper_stack_size;
+DEFINE_STATIC_LOCK (reaper_lock);
+
+
+/* Wait for the helper threads of all jobs in the list JOBS.  The jobs
+   share one STOP_TIMEOUT budget: the I/O of all readers is cancelled
+   at once and that of all writers after WRITER_GRACE, so that no job
+   waits for the one before it.  */
+static void
+wait_close_jobs (struct close_job_s *jobs)
+{
+  struct close_job_s *job;
+  DWORD start, elapsed;
+  int pending;
+
+  start = GetTickCount ();
+  for (;;)
+    {
+      elapsed = GetTickCount () - start;
+      pending = 0;
+      for (job = jobs; job; job = job->next)
+        {
+          if (job->reader && (WaitForSingleObject (job->reader->stopped, 0)
+                              != WAIT_OBJECT_0))
+            {
+              pending = 1;
+              cancel_thread_io (job->reader->thread_hd);
+            }
+          if (job->writer && (WaitForSingleObject (job->writer->stopped, 0)
+                              != WAIT_OBJECT_0))
+            {
+              pending = 1;
+              if (elapsed >= WRITER_GRACE)
+                cancel_thread_io (job->writer->thread_hd);
+            }
+        }
+      if (!pending || elapsed >= STOP_TIMEOUT)
+        break;
+      Sleep (STOP_SLICE);
+    }
+}
+
+
+/* Release the helper contexts of JOB, which has been passed to
+   wait_close_jobs, and close its handle.  */
+static void
+finish_close_job (struct close_job_s *job)
+{
+  if (job->reader)
+    reap_reader (job->reader);
+  if (job->writer)
+    reap_writer (job->writer);
+  if (!CloseHandle (fd_to_handle (job->fd)))
+    TRACE2 (DEBUG_SYSIO, "pth:reaper", job->fd,
+            "CloseHandle(%d) failed: ec=%d", job->fd, (int) GetLastError ());
+  _pth_free (job);
+}
+
+
+static DWORD CALLBACK
+reaper (void *arg)
+{
+  struct close_job_s *jobs, *job;
+
+  (void)arg;
+  for (;;)
+    {
+      WaitForSingleObject (reaper_ev, INFINITE);
+      LOCK (reaper_lock);
+      jobs = reaper_queue;
+      reaper_queue = NULL;
+      reaper_tail = &reaper_queue;
+      UNLOCK (reaper_lock);
+
+      wait_close_jobs (jobs);
+      while ((job = jobs))
+        {
+          jobs = job->next;
+          finish_close_job (job);
+        }
+    }
+  return 0;
+}
+
+
+/* Queue JOB for the reaper thread, which is started on first use.
+   Returns -1 if that is not possible.  */
+static int
+queue_close_job (struct close_job_s *job)
+{
+  int rc = 0;
+
+  LOCK (reaper_lock);
+  if (!reaper_thread)
+    {
+      if (!reaper_ev)
+        reaper_ev = CreateEvent (NULL, FALSE, FALSE, NULL);
+      if (reaper_ev)
+        reaper_thread = create_helper_thread (NULL, reaper, NULL,
+                                              &reaper_stack_size);
+      if (!reaper_thread)
+        {
+          TRACE1 (DEBUG_SYSIO, "pth:reaper", job->fd,
+                  "can't start reaper: ec=%d", (int) GetLastError ());
+          rc = -1;
+        }
+    }
+  if (!rc)
+    {
+      /* Append so that descriptors are closed in order.  */
+      job->next = NULL;
+      *reaper_tail = job;
+      reaper_tail = &job->next;
+      SetEvent (reaper_ev);
+    }
+  UNLOCK (reaper_lock);
+  return rc;
+}
+
+
+/* Close FD like pth_close but leave the waiting for the helper
+   threads and the closing of the handle to a background thread.  */
+int
+pth_close_async (int fd)
+{
+  struct close_job_s *job;
+  TRACE_BEG (DEBUG_SYSIO, "pth_close_async", fd);
+
+  if (fd == -1)
+    {
+      set_errno (EBADF);
+      return TRACE_SYSRES (-1);
+    }
+
+  job = _pth_calloc (1, sizeof *job);
+  if (!job)
+    return TRACE_SYSRES (pth_close (fd));
+
+  job->fd = fd;
+  job->reader = detach_reader (fd);
+  if (job->reader && !stop_reader (job->reader))
+    job->reader = NULL;
+  job->writer = detach_writer (fd);
+  if (job->writer && !stop_writer (job->writer))
+    job->writer = NULL;
+  drop_fdstats (fd);
+
+  if (queue_close_job (job))
+    {
+      /* Do it ourself.  */
+      job->next = NULL;
+      wait_close_jobs (job);
+      finish_close_job (job);
+    }
+
+  return TRACE_SYSRES (0);
+}
+
+
+/* Close the NFDS descriptors in FDS in the background.  All helper
+   threads are told to stop before the first one is waited for.
+   Returns -1 with ERRNO set if one of the descriptors is invalid;
+   the others are closed anyway.  */
+int
+pth_close_many (int *fds, int nfds)
+{
+  int i, rc = 0;
+
+  for (i = 0; i < nfds; i++)
+    if (pth_close_async (fds[i]))
+      rc = -1;
+  return rc;
+}
+
+
 HANDLE
 _pth_get_reader_ev (int fd)
 {
@@ -1254,6 +2291,19 @@ _pth_get_reader_ev (int fd)
 }
 
 
+/* Return the event which is set when more data arrives for FD.  */
+HANDLE
+_pth_get_reader_more_ev (int fd)
+{
+  struct reader_context_s *ctx = find_reader (fd, 0);
+  
+  if (! ctx)
+    return INVALID_HANDLE_VALUE;
+
+  return ctx->more_data_ev;
+}
+
+
 HANDLE
 _pth_get_writer_ev (int fd)
 {
@@ -25,6 +25,7 @@
 void *pth_malloc (size_t n);
 void *pth_calloc (size_t n, size_t m);
 void _pth_free (void *p);
+int map_wsa_to_errno (long wsa_err);
 
 
 /* w32-io.c */
@@ -32,10 +33,22 @@ void _pth_sema_subsystem_init (void);
 
 /* For select.  */
 HANDLE _pth_get_reader_ev (int fd);
+HANDLE _pth_get_reader_more_ev (int fd);
 HANDLE _pth_get_writer_ev (int fd);
 
 int _pth_io_read (int fd, void *buffer, size_t count);
+int _pth_io_read_until (int fd, void *buffer, size_t count, int delim);
+int _pth_io_peek (int fd, void *buffer, size_t count, size_t mincount);
+int _pth_io_avail (int fd);
 int _pth_io_write (int fd, const void *buffer, size_t count);
+int _pth_io_splice (int in_fd, int out_fd, size_t count);
+int _pth_io_flush (int fd);
+void _pth_io_set_coalesce (int enable);
+void _pth_io_account (int fd, int writing, int nbytes);
+void _pth_io_set_fdstats (int enable);
+int _pth_io_get_fdstats (int fd, unsigned long values[8]);
+unsigned int _pth_io_set_helper_stack (unsigned int size);
+long _pth_io_get_helper_stats (long *r_reserved);
 
 
 #endif	/* W32_IO_H */
@@ -28,8 +28,14 @@
 
 #include <winsock2.h>
 #include <windows.h>
+#ifndef HAVE_W32CE_SYSTEM
+# include <mswsock.h>  /* For TransmitFile and AcceptEx.  */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
 #include <io.h>
 #ifdef HAVE_SIGNAL_H
 # include <signal.h>
@@ -81,12 +87,53 @@ static HANDLE pth_signo_ev;
 /* Mutex to make sure only one thread is running. */
 static CRITICAL_SECTION pth_shd;
 
+#ifndef HAVE_W32CE_SYSTEM
+/* Lock for the AcceptEx pools.  */
+static CRITICAL_SECTION accept_pool_lock;
+#endif
+
+/* Interval in milliseconds in which pth_peek_ev polls a socket while
+   it waits for more data.  */
+#define PEEK_POLL_MS 10
+
+/* Spin count for PTH_SHD.  A thread leaving pth usually finds the
+   lock released a moment later by the thread entering pth.  */
+#define PTH_SHD_SPINCOUNT 4000
+
+/* Bounds for the adaptive spinning of a contended mutex.  */
+#define MUTEX_SPIN_MIN 10
+#define MUTEX_SPIN_MAX 1000
+
+#ifndef YieldProcessor
+# define YieldProcessor() do { } while (0)
+#endif
+
+/* Number of processors; spinning is useless on a single one.  */
+static int ncpus;
+
 /* A sentinel to catch bogus use of pth_enter/pth_leave.  */
 static int enter_leave_api_sentinel;
 
 /* Counter to track the number of PTH threads.  */
 static int thread_counter;
 
+/* The W32 TLS slot holding the array with the values of the pth keys
+   of a thread.  The array is allocated on the first pth_key_setdata
+   of that thread.  */
+static DWORD key_tls_slot = TLS_OUT_OF_INDEXES;
+
+/* The table of pth keys.  It is only changed with the world lock
+   held.  */
+static struct
+{
+  int used;
+  void (*destructor)(void *);
+} key_table[PTH_KEY_MAX];
+
+/* Number of rounds to call the destructors in case a destructor sets
+   a value again.  */
+#define KEY_DESTRUCTOR_ITERATIONS 4
+
 /* Object used by update_fdarray.  */
 struct fdarray_item_s 
 {
@@ -137,6 +184,7 @@ struct pth_event_s
     } sig;                    /* Used for PTH_EVENT_SIGS.  */
     struct timeval   tv;      /* Used for PTH_EVENT_TIME.  */
     pth_mutex_t     *mx;      /* Used for PTH_EVENT_MUTEX.  */
+    pth_sem_t       *sem;     /* Used for PTH_EVENT_SEM.  */
   } u;
   unsigned int flags;   /* Flags used to further describe an event.
                            This is the bit wise combination of
@@ -144,6 +192,11 @@ struct pth_event_s
   pth_status_t status;  /* Current status of the event.  */
 };
 
+/* Internal event flag: The handle of a PTH_EVENT_HANDLE event is not
+   reset by pth_wait.  Used for our own auto-reset events where a
+   reset could swallow a wakeup meant for another thread.  */
+#define EVENT_FLAG_NO_RESET  (1<<30)
+
 
 /* Attribute object for threads.  */
 struct pth_attr_s 
@@ -151,6 +204,26 @@ struct pth_attr_s
   unsigned int flags;
   unsigned int stack_size;
   char *name;
+  unsigned int cancel_state;    /* 0 for PTH_CANCEL_DEFAULT.  */
+  struct thread_info_s *bound;  /* Thread of an attribute returned by
+                                   pth_attr_of or NULL.  */
+};
+
+/* A cleanup handler pushed by pth_cleanup_push.  */
+struct cleanup_s
+{
+  struct cleanup_s *next;
+  void (*func)(void *);
+  void *arg;
+};
+
+
+/* The read locks a thread holds on the rwlock RW.  */
+struct rdlock_s
+{
+  struct rdlock_s *next;
+  struct rwlock_s *rw;
+  int count;
 };
 
 
@@ -163,8 +236,57 @@ struct thread_info_s
   int joinable;            /* True if this Thread is joinable.  */
   HANDLE th;               /* Handle of this thread.  Used by non-joinable
                               threads to close the handle.  */
+  struct thread_info_s *next;  /* Link of THREAD_LIST.  */
+  void *stack;             /* An address within the thread's stack.  */
+  int refs;                /* References by the thread itself, by a
+                              not yet done pth_join and by bound
+                              attribute objects.  */
+  void *exit_value;        /* Value returned by the thread.  */
+  int joined;              /* pth_join has been called.  */
+  unsigned int cancel_state;
+  int cancel_pending;      /* pth_cancel has been called.  */
+  HANDLE cancel_ev;        /* Manual-reset event signaled by pth_cancel;
+                              watched by waits at cancellation
+                              points.  */
+  struct cleanup_s *cleanups;
+  char *name;              /* Malloced name of the thread or NULL.  */
+  unsigned int stack_size; /* Requested stack reservation.  */
+  pth_state_t state;
+  int dispatches;          /* Number of times the thread got the world
+                              lock.  */
+  pth_time_t spawned;      /* Time the thread was spawned.  */
+  LONGLONG last_dispatch;  /* Performance counter when the thread last
+                              got the world lock.  */
+  LONGLONG ran;            /* Performance counter ticks the thread held
+                              the world lock.  */
+  struct rdlock_s *rdlocks; /* Read locks held, by rwlock.  */
 };
 
+/* The W32 TLS slot holding the thread_info_s of a thread.  */
+static DWORD thread_tls_slot = TLS_OUT_OF_INDEXES;
+
+/* The info for the thread which called pth_init.  */
+static struct thread_info_s main_thread_info;
+
+/* Frequency of the performance counter and a counter value and the
+   corresponding time in microseconds since the Epoch, used to convert
+   counter values to absolute times.  */
+static LONGLONG perf_freq;
+static LONGLONG perf_base;
+static ULONGLONG perf_base_usec;
+
+/* List of running threads started by pth_spawn.  Only accessed with
+   the world lock held.  */
+static struct thread_info_s *thread_list;
+
+/* Stack size reserved for a new thread if the attribute does not
+   specify one.  0 uses the size from the executable's header.  */
+static unsigned int default_stack_size;
+
+#ifndef STACK_SIZE_PARAM_IS_A_RESERVATION
+# define STACK_SIZE_PARAM_IS_A_RESERVATION 0x00010000
+#endif
+
 
 /* Convenience macro to startup the system.  */
 #define implicit_init() do { if (!pth_initialized) pth_init(); } while (0)
@@ -173,8 +295,17 @@ struct thread_info_s
 static pth_event_t do_pth_event (unsigned long spec, ...);
 static unsigned int do_pth_waitpid (unsigned pid, int * status, int options);
 static int do_pth_wait (pth_event_t ev);
+static int do_pth_wait_ex (pth_event_t ev, int cancelable);
+static int cancel_requested (void);
+static int cancel_enabled (void);
+static int wait_for_fd (int fd, int writeable, pth_event_t ev_extra);
+static void test_cancel (void);
 static void *launch_thread (void * ctx);
+static void exit_thread (struct thread_info_s *c, void *value);
+static void unlink_thread (struct thread_info_s *c);
 static int do_pth_event_free (pth_event_t ev, int mode);
+static long fd_avail (int fd);
+static long stack_commit_total (void);
 
 
 
@@ -358,6 +489,40 @@ map_wsa_to_errno (long wsa_err)
     case WSAENOTEMPTY:
       return ENOTEMPTY;
 
+      /* Newer runtimes provide the POSIX network error codes.  */
+#ifdef ECONNREFUSED
+    case WSAECONNREFUSED:
+      return ECONNREFUSED;
+#endif
+#ifdef ETIMEDOUT
+    case WSAETIMEDOUT:
+      return ETIMEDOUT;
+#endif
+#ifdef ENETUNREACH
+    case WSAENETUNREACH:
+      return ENETUNREACH;
+#endif
+#ifdef EHOSTUNREACH
+    case WSAEHOSTUNREACH:
+      return EHOSTUNREACH;
+#endif
+#ifdef ECONNRESET
+    case WSAECONNRESET:
+      return ECONNRESET;
+#endif
+#ifdef EADDRINUSE
+    case WSAEADDRINUSE:
+      return EADDRINUSE;
+#endif
+#ifdef EISCONN
+    case WSAEISCONN:
+      return EISCONN;
+#endif
+#ifdef EALREADY
+    case WSAEALREADY:
+      return EALREADY;
+#endif
+
     default:
       return EIO;
     }
@@ -723,6 +888,67 @@ destroy_timer (HANDLE h)
 }
 
 
+/* Return the current value of the performance counter.  */
+static LONGLONG
+perf_counter (void)
+{
+  LARGE_INTEGER li;
+
+  if (!perf_freq || !QueryPerformanceCounter (&li))
+    return 0;
+  return li.QuadPart;
+}
+
+
+/* Return the current time in microseconds since the Epoch.  */
+static ULONGLONG
+current_time_usec (void)
+{
+  FILETIME ft;
+  ULARGE_INTEGER u;
+#ifdef HAVE_W32CE_SYSTEM
+  SYSTEMTIME st;
+
+  GetSystemTime (&st);
+  SystemTimeToFileTime (&st, &ft);
+#else
+  GetSystemTimeAsFileTime (&ft);
+#endif
+  u.LowPart = ft.dwLowDateTime;
+  u.HighPart = ft.dwHighDateTime;
+  /* Convert from 100ns units since 1601-01-01.  */
+  return (u.QuadPart - 116444736000000000ULL) / 10;
+}
+
+
+/* Convert the performance counter difference TICKS to
+   microseconds.  */
+static ULONGLONG
+ticks_to_usec (LONGLONG ticks)
+{
+  if (!perf_freq || ticks < 0)
+    return 0;
+  return ((ticks / perf_freq) * 1000000
+          + (ticks % perf_freq) * 1000000 / perf_freq);
+}
+
+
+static void
+usec_to_time (ULONGLONG usec, pth_time_t *t)
+{
+  t->tv_sec = (long)(usec / 1000000);
+  t->tv_usec = (long)(usec % 1000000);
+}
+
+
+static struct thread_info_s *
+current_thread_info (void)
+{
+  if (thread_tls_slot == TLS_OUT_OF_INDEXES)
+    return NULL;
+  return TlsGetValue (thread_tls_slot);
+}
+
 
 
 
@@ -732,6 +958,8 @@ int
 pth_init (void)
 {
   WSADATA wsadat;
+  SYSTEM_INFO si;
+  LARGE_INTEGER li;
   const char *s;
 
   if (pth_initialized)
@@ -782,7 +1010,17 @@ pth_init (void)
   if (WSAStartup (0x202, &wsadat))
     return FALSE;
   pth_signo = 0;
+  GetSystemInfo (&si);
+  ncpus = si.dwNumberOfProcessors;
+#ifdef HAVE_W32CE_SYSTEM
   InitializeCriticalSection (&pth_shd);
+#else
+  if (!InitializeCriticalSectionAndSpinCount (&pth_shd,
+                                              ncpus > 1
+                                              ? PTH_SHD_SPINCOUNT : 0))
+    return FALSE;
+  InitializeCriticalSection (&accept_pool_lock);
+#endif
   if (pth_signo_ev)
     CloseHandle (pth_signo_ev);
 
@@ -790,6 +1028,24 @@ pth_init (void)
   if (!pth_signo_ev)
     return FALSE;
 
+  if (key_tls_slot == TLS_OUT_OF_INDEXES)
+    {
+      key_tls_slot = TlsAlloc ();
+      if (key_tls_slot == TLS_OUT_OF_INDEXES)
+        return FALSE;
+    }
+  if (thread_tls_slot == TLS_OUT_OF_INDEXES)
+    {
+      thread_tls_slot = TlsAlloc ();
+      if (thread_tls_slot == TLS_OUT_OF_INDEXES)
+        return FALSE;
+    }
+
+  if (QueryPerformanceFrequency (&li))
+    perf_freq = li.QuadPart;
+  perf_base = perf_counter ();
+  perf_base_usec = current_time_usec ();
+
 #ifdef HAVE_W32CE_SYSTEM
   InitializeCriticalSection (&w32ce_timer_cs);
   w32ce_timer_ev = CreateEvent (NULL, FALSE, FALSE, NULL);
@@ -801,6 +1057,14 @@ pth_init (void)
   pth_initialized = 1;
   thread_counter = 1;
   EnterCriticalSection (&pth_shd);
+
+  main_thread_info.refs = 1;
+  main_thread_info.cancel_state = PTH_CANCEL_DEFAULT;
+  main_thread_info.state = PTH_STATE_READY;
+  main_thread_info.dispatches = 1;
+  usec_to_time (perf_base_usec, &main_thread_info.spawned);
+  main_thread_info.last_dispatch = perf_base;
+  TlsSetValue (thread_tls_slot, &main_thread_info);
   return TRUE;
 }
 
@@ -818,6 +1082,8 @@ pth_kill (void)
     {
 #ifdef HAVE_W32CE_SYSTEM
       DeleteCriticalSection (&w32ce_timer_cs);
+#else
+      DeleteCriticalSection (&accept_pool_lock);
 #endif /*HAVE_W32CE_SYSTEM*/  
       DeleteCriticalSection (&pth_shd);
     }
@@ -830,10 +1096,17 @@ pth_kill (void)
 static void
 enter_pth (const char *function)
 {
+  struct thread_info_s *ti = current_thread_info ();
+
   /* Fixme: I am not sure whether the same thread my enter a critical
      section twice.  */
   if (DBG_CALLS)
     _pth_debug (DEBUG_CALLS, "enter_pth (%s)\n", function? function:"");
+  if (ti)
+    {
+      ti->ran += perf_counter () - ti->last_dispatch;
+      ti->state = PTH_STATE_WAITING;
+    }
   LeaveCriticalSection (&pth_shd);
 }
 
@@ -841,7 +1114,16 @@ enter_pth (const char *function)
 static void
 leave_pth (const char *function)
 {
+  struct thread_info_s *ti;
+
   EnterCriticalSection (&pth_shd);
+  ti = current_thread_info ();
+  if (ti)
+    {
+      ti->dispatches++;
+      ti->last_dispatch = perf_counter ();
+      ti->state = PTH_STATE_READY;
+    }
   if (DBG_CALLS)
     _pth_debug (DEBUG_CALLS, "leave_pth (%s)\n", function? function:"");
 }
@@ -877,6 +1159,9 @@ pth_leave (void)
 long 
 pth_ctrl (unsigned long query, ...)
 {
+  va_list arg_ptr;
+  long result = 0;
+
   implicit_init ();
 
   switch (query)
@@ -907,10 +1192,76 @@ pth_ctrl (unsigned long query, ...)
     case PTH_CTRL_GETTHREADS:
       return thread_counter;
 
+    case PTH_CTRL_SETCOALESCE:
+      va_start (arg_ptr, query);
+      _pth_io_set_coalesce (va_arg (arg_ptr, int));
+      va_end (arg_ptr);
+      break;
+
+    case PTH_CTRL_SETSTACKSIZE:
+      va_start (arg_ptr, query);
+      result = default_stack_size;
+      default_stack_size = va_arg (arg_ptr, unsigned int);
+      va_end (arg_ptr);
+      break;
+
+    case PTH_CTRL_GETSTACKCOMMIT:
+      result = stack_commit_total ();
+      break;
+
+    case PTH_CTRL_SETHELPERSTACK:
+      va_start (arg_ptr, query);
+      result = _pth_io_set_helper_stack (va_arg (arg_ptr, unsigned int));
+      va_end (arg_ptr);
+      break;
+
+    case PTH_CTRL_GETHELPERTHREADS:
+      result = _pth_io_get_helper_stats (NULL);
+      break;
+
+    case PTH_CTRL_GETHELPERSTACK:
+      _pth_io_get_helper_stats (&result);
+      break;
+
+    case PTH_CTRL_GETFDAVAIL:
+      va_start (arg_ptr, query);
+      result = fd_avail (va_arg (arg_ptr, int));
+      va_end (arg_ptr);
+      break;
+
+    case PTH_CTRL_SETFDSTATS:
+      va_start (arg_ptr, query);
+      _pth_io_set_fdstats (va_arg (arg_ptr, int));
+      va_end (arg_ptr);
+      break;
+
+    case PTH_CTRL_GETFDSTATS:
+      {
+        struct pth_fdstats_s *stats;
+        unsigned long values[8];
+        int fd;
+
+        va_start (arg_ptr, query);
+        fd = va_arg (arg_ptr, int);
+        stats = va_arg (arg_ptr, struct pth_fdstats_s *);
+        va_end (arg_ptr);
+        if (!stats || _pth_io_get_fdstats (fd, values))
+          return -1;
+        stats->bytes_in = values[0];
+        stats->bytes_out = values[1];
+        stats->read_calls = values[2];
+        stats->write_calls = values[3];
+        stats->reader_stalls = values[4];
+        stats->read_waits = values[5];
+        stats->write_waits = values[6];
+        stats->write_wait_ms = values[7];
+      }
+      break;
+
     default:
       return -1;
     }
-  return 0;
+  return result;
 }
 
 
@@ -1045,6 +1396,7 @@ do_pth_read (int fd,  void * buffer, size_t size)
                         fd, (int)WSAGetLastError ());
           set_errno (map_wsa_to_errno (WSAGetLastError ()));
         }
+      _pth_io_account (fd, 0, n);
     }
 
   TRACE_SYSRES (n);
@@ -1078,17 +1430,17 @@ pth_read_ev (int fd, void *buffer, size_t size, pth_event_t ev_extra)
   do_pth_wait (ev);
 
   if (ev_extra)
+    pth_event_isolate (ev);
+  if (ev->status != PTH_STATUS_OCCURRED
+      && (ev_extra || cancel_requested ()))
     {
-      pth_event_isolate (ev);
-      if (ev->status != PTH_STATUS_OCCURRED)
-	{
 #ifdef NO_PTH_MODE_STATIC
-	  do_pth_event_free (ev, PTH_FREE_THIS);
+      do_pth_event_free (ev, PTH_FREE_THIS);
 #endif
-	  set_errno (EINTR);
-	  leave_pth (__FUNCTION__);
-	  return -1;
-	}
+      set_errno (EINTR);
+      leave_pth (__FUNCTION__);
+      test_cancel ();
+      return -1;
     }
 #ifdef NO_PTH_MODE_STATIC
   do_pth_event_free (ev, PTH_FREE_THIS);
@@ -1097,6 +1449,7 @@ pth_read_ev (int fd, void *buffer, size_t size, pth_event_t ev_extra)
   n = do_pth_read (fd, buffer, size);
 
   leave_pth (__FUNCTION__);
+  test_cancel ();
   return n;
 }
 
@@ -1107,15 +1460,266 @@ pth_read (int fd,  void * buffer, size_t size)
   int n;
 
   implicit_init ();
+  test_cancel ();
   enter_pth (__FUNCTION__);
 
-  n = do_pth_read (fd, buffer, size);
+  /* A read from a helper thread may block for long; wait for data at a
+     cancellation point first.  */
+  if (cancel_enabled () && _pth_get_reader_ev (fd) != INVALID_HANDLE_VALUE
+      && wait_for_fd (fd, 0, NULL))
+    n = -1;
+  else
+    n = do_pth_read (fd, buffer, size);
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return n;
+}
+
+
+/* Read from FD until DELIM has been read or SIZE bytes are stored.
+   Nothing after the delimiter is taken from FD.  */
+static int
+do_pth_read_until (int fd, void *buffer, size_t size, int delim)
+{
+  char *p = buffer;
+  const char *d;
+  int n, total = 0;
+
+  TRACE_BEG1 (DEBUG_INFO, "do_pth_read_until", fd, "delim=%d", delim);
+
+  if (_pth_get_reader_ev (fd) != INVALID_HANDLE_VALUE)
+    total = _pth_io_read_until (fd, buffer, size, delim);
+  else if (is_socket_2 (fd))
+    {
+      /* Peek at what is queued and then take the data up to and
+         including the delimiter.  */
+      while ((size_t)total < size)
+        {
+          n = recv (fd, p + total, size - total, MSG_PEEK);
+          /* Peeked bytes are counted when they are taken.  */
+          _pth_io_account (fd, 0, 0);
+          if (n > 0)
+            {
+              d = memchr (p + total, delim, n);
+              if (d)
+                n = d - (p + total) + 1;
+              n = recv (fd, p + total, n, 0);
+              _pth_io_account (fd, 0, n);
+            }
+          if (n == -1)
+            {
+              if (DBG_ERROR)
+                _pth_debug (0, "pth_read_until(0x%x) recv failed: "
+                            "ec=%d\n", fd, (int)WSAGetLastError ());
+              set_errno (map_wsa_to_errno (WSAGetLastError ()));
+              if (!total)
+                total = -1;
+              break;
+            }
+          if (!n)
+            break;
+          total += n;
+          if (p[total-1] == (char)delim)
+            break;
+        }
+    }
+  else
+    {
+      /* We can't look ahead on other handles.  */
+      while ((size_t)total < size)
+        {
+          n = do_pth_read (fd, p + total, 1);
+          if (n == -1 && !total)
+            total = -1;
+          if (n <= 0)
+            break;
+          if (p[total++] == (char)delim)
+            break;
+        }
+    }
+
+  TRACE_SYSRES (total);
+  return total;
+}
+
+
+int
+pth_read_until (int fd, void *buffer, size_t size, int delim)
+{
+  int n;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  n = do_pth_read_until (fd, buffer, size, delim);
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return n;
+}
+
+
+int
+pth_read_line (int fd, void *buffer, size_t size)
+{
+  return pth_read_until (fd, buffer, size, '\n');
+}
+
+
+/* Wait until the event EV, which is freed, or EV_EXTRA occurred.
+   Returns 0 if EV occurred or -1 with ERRNO set to EINTR.  */
+static int
+wait_peek_event (pth_event_t ev, pth_event_t ev_extra)
+{
+  int rc = 0;
+
+  if (ev_extra)
+    pth_event_concat (ev, ev_extra, NULL);
+  do_pth_wait (ev);
+  if (ev_extra)
+    pth_event_isolate (ev);
+  if (ev->status != PTH_STATUS_OCCURRED
+      && (ev_extra || cancel_requested ()))
+    {
+      set_errno (EINTR);
+      rc = -1;
+    }
+  do_pth_event_free (ev, PTH_FREE_THIS);
+  return rc;
+}
+
+
+static int
+do_pth_peek (int fd, void *buffer, size_t size, size_t minsize,
+             pth_event_t ev_extra)
+{
+  pth_event_t ev;
+  DWORD navail;
+  int n;
+
+  if (!size)
+    return 0;
+  if (minsize > size)
+    minsize = size;
+  if (!minsize)
+    minsize = 1;
+
+  if (_pth_get_reader_ev (fd) != INVALID_HANDLE_VALUE)
+    {
+      for (;;)
+        {
+          if (wait_for_fd (fd, 0, ev_extra))
+            return -1;
+          n = _pth_io_peek (fd, buffer, size, minsize);
+          if (n != -1 || errno != EAGAIN)
+            return n;
+          ev = do_pth_event (PTH_EVENT_HANDLE,
+                             _pth_get_reader_more_ev (fd));
+          if (!ev)
+            return -1;
+          /* Other peekers may wait for the same event.  */
+          ev->flags |= EVENT_FLAG_NO_RESET;
+          if (wait_peek_event (ev, ev_extra))
+            return -1;
+        }
+    }
+  else if (is_socket_2 (fd))
+    {
+      for (;;)
+        {
+          if (wait_for_fd (fd, 0, ev_extra))
+            return -1;
+          n = recv (fd, buffer, size, MSG_PEEK);
+          /* Peeked bytes are counted when they are read.  */
+          _pth_io_account (fd, 0, 0);
+          if (n == -1)
+            {
+              set_errno (map_wsa_to_errno (WSAGetLastError ()));
+              return -1;
+            }
+          if (!n || (size_t)n >= minsize)
+            return n;
+          /* The socket stays readable while data is pending, thus
+             we poll for more.  */
+          ev = do_pth_event (PTH_EVENT_TIME,
+                             pth_timeout (0, PEEK_POLL_MS * 1000));
+          if (!ev)
+            return -1;
+          if (wait_peek_event (ev, ev_extra))
+            return -1;
+        }
+    }
+  else
+    {
+      _pth_io_account (fd, 0, 0);
+      if (!PeekNamedPipe ((HANDLE)fd, buffer, size, &navail, NULL, NULL))
+        {
+          set_errno (map_w32_to_errno (GetLastError ()));
+          return -1;
+        }
+      if (navail < minsize)
+        {
+          set_errno (EAGAIN);
+          return -1;
+        }
+    }
+  return (int)navail;
+}
 
+
+/* Copy up to SIZE bytes which are available for reading from FD to
+   BUFFER without consuming them.  Blocks until at least MINSIZE bytes
+   are available, EOF or an error occurred or EV_EXTRA occurred.
+   Pipes without a reader thread are never waited for; -1 is returned
+   with ERRNO set to EAGAIN if less than MINSIZE bytes are
+   available.  */
+int
+pth_peek_ev (int fd, void *buffer, size_t size, size_t minsize,
+             pth_event_t ev_extra)
+{
+  int n;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+  n = do_pth_peek (fd, buffer, size, minsize, ev_extra);
   leave_pth (__FUNCTION__);
+  test_cancel ();
   return n;
 }
 
 
+int
+pth_peek (int fd, void *buffer, size_t size)
+{
+  return pth_peek_ev (fd, buffer, size, 1, NULL);
+}
+
+
+/* Return the number of bytes which can be read from FD without
+   blocking or -1 if this is not known.  */
+static long
+fd_avail (int fd)
+{
+  unsigned long nsock;
+  DWORD npipe;
+  int n;
+
+  n = _pth_io_avail (fd);
+  if (n != -1)
+    return n;
+  if (is_socket_2 (fd))
+    {
+      if (ioctlsocket (fd, FIONREAD, &nsock))
+        return -1;
+      return (long)nsock;
+    }
+  if (PeekNamedPipe ((HANDLE)fd, NULL, 0, NULL, &npipe, NULL))
+    return (long)npipe;
+  return -1;
+}
+
+
 static int
 do_pth_write (int fd, const void *buffer, size_t size)
 {
@@ -1178,6 +1782,7 @@ do_pth_write (int fd, const void *buffer, size_t size)
                         fd, (int)WSAGetLastError ());
           set_errno (map_wsa_to_errno (WSAGetLastError ()));
         }
+      _pth_io_account (fd, 1, n);
     }
 
   TRACE_SYSRES (n);
@@ -1210,18 +1815,17 @@ pth_write_ev (int fd, const void *buffer, size_t size, pth_event_t ev_extra)
 
   do_pth_wait (ev);
   if (ev_extra)
+    pth_event_isolate (ev);
+  if (pth_event_status(ev) != PTH_STATUS_OCCURRED
+      && (ev_extra || cancel_requested ()))
     {
-      pth_event_isolate (ev);
-
-      if (pth_event_status(ev) != PTH_STATUS_OCCURRED)
-	{
 #ifdef NO_PTH_MODE_STATIC
-          do_pth_event_free (ev, PTH_FREE_THIS);
+      do_pth_event_free (ev, PTH_FREE_THIS);
 #endif
-          set_errno (EINTR);
-	  leave_pth (__FUNCTION__);
-	  return -1;
-	}
+      set_errno (EINTR);
+      leave_pth (__FUNCTION__);
+      test_cancel ();
+      return -1;
     }
 #ifdef NO_PTH_MODE_STATIC
   do_pth_event_free (ev, PTH_FREE_THIS);
@@ -1230,6 +1834,7 @@ pth_write_ev (int fd, const void *buffer, size_t size, pth_event_t ev_extra)
   n = do_pth_write (fd, buffer, size);
 
   leave_pth (__FUNCTION__);
+  test_cancel ();
   return n;
 }
 
@@ -1240,28 +1845,241 @@ pth_write (int fd, const void *buffer, size_t size)
   int n;
 
   implicit_init ();
+  test_cancel ();
   enter_pth (__FUNCTION__);
 
   n = do_pth_write (fd, buffer, size);
 
   leave_pth (__FUNCTION__);
+  test_cancel ();
   return n;
 }
 
 
-static void
-show_event_ring (const char *text, pth_event_t ev)
+/* Wait until FD becomes readable or, if WRITEABLE is set, writeable.
+   If EV_EXTRA is not NULL the wait is also terminated by one of its
+   events and it is always terminated by a cancellation request; in
+   these cases -1 is returned and ERRNO set to EINTR.  Must be
+   called between enter_pth and leave_pth.  */
+static int
+wait_for_fd (int fd, int writeable, pth_event_t ev_extra)
 {
-  pth_event_t r;
+  static pth_key_t ev_key = PTH_KEY_INIT;
+  pth_event_t ev;
 
+  ev = do_pth_event (PTH_EVENT_FD | PTH_MODE_STATIC
+                     | (writeable? PTH_UNTIL_FD_WRITEABLE
+                        /*     */: PTH_UNTIL_FD_READABLE),
+                     &ev_key, fd);
   if (!ev)
-    {
-      _pth_debug (0, "show_event_ring(%s):  No ring\n", text);
-      return;
-    }
+    return -1;
 
-  r = ev;
-  do
+  if (ev_extra)
+    pth_event_concat (ev, ev_extra, NULL);
+
+  do_pth_wait (ev);
+
+  if (ev_extra)
+    pth_event_isolate (ev);
+  if (ev->status != PTH_STATUS_OCCURRED
+      && (ev_extra || cancel_requested ()))
+    {
+#ifdef NO_PTH_MODE_STATIC
+      do_pth_event_free (ev, PTH_FREE_THIS);
+#endif
+      set_errno (EINTR);
+      return -1;
+    }
+#ifdef NO_PTH_MODE_STATIC
+  do_pth_event_free (ev, PTH_FREE_THIS);
+#endif
+  return 0;
+}
+
+
+#ifndef HAVE_W32CE_SYSTEM
+/* Send up to SIZE bytes starting at the current position of the disk
+   file IN_FD to the socket OUT_FD.  This uses TransmitFile so that
+   the data is directly passed from the file system cache to the
+   network stack.  The file position is advanced by the number of
+   bytes sent.  */
+static int
+transmit_file (int in_fd, int out_fd, size_t size)
+{
+  HANDLE hd = (HANDLE)in_fd;
+  unsigned long long pos, fsize;
+  DWORD low, high;
+  LONG poshigh;
+  int n;
+  char strerr[256];
+
+  TRACE_BEG1 (DEBUG_INFO, "transmit_file", in_fd, "out_fd=0x%x", out_fd);
+
+  poshigh = 0;
+  low = SetFilePointer (hd, 0, &poshigh, FILE_CURRENT);
+  if (low == INVALID_SET_FILE_POINTER && GetLastError () != NO_ERROR)
+    goto w32_error;
+  pos = ((unsigned long long)(DWORD)poshigh << 32) | low;
+
+  low = GetFileSize (hd, &high);
+  if (low == INVALID_FILE_SIZE && GetLastError () != NO_ERROR)
+    goto w32_error;
+  fsize = ((unsigned long long)high << 32) | low;
+
+  if (fsize <= pos)
+    return TRACE_SYSRES (0);  /* EOF.  */
+  if (fsize - pos < size)
+    size = (size_t)(fsize - pos);
+  if (size > 0x7fffffff)
+    size = 0x7fffffff;
+  n = (int)size;
+
+  TRACE_LOG1 ("  TransmitFile size=%d", n);
+  if (!TransmitFile ((SOCKET)out_fd, hd, n, 0, NULL, NULL, 0))
+    {
+      _pth_io_account (out_fd, 1, -1);
+      if (DBG_ERROR)
+        _pth_debug (0, "pth_splice(0x%x) TransmitFile failed: %s\n",
+                    in_fd, wsa_strerror (strerr, sizeof strerr));
+      set_errno (map_wsa_to_errno (WSAGetLastError ()));
+      return TRACE_SYSRES (-1);
+    }
+
+  _pth_io_account (in_fd, 0, n);
+  _pth_io_account (out_fd, 1, n);
+
+  /* Set the file pointer explicitly; this way we don't depend on
+     whether TransmitFile updates it.  */
+  pos += n;
+  poshigh = (LONG)(pos >> 32);
+  SetFilePointer (hd, (LONG)(pos & 0xffffffff), &poshigh, FILE_BEGIN);
+
+  return TRACE_SYSRES (n);
+
+ w32_error:
+  if (DBG_ERROR)
+    _pth_debug (0, "pth_splice(0x%x) can't get file position: %s\n",
+                in_fd, w32_strerror (strerr, sizeof strerr));
+  set_errno (map_w32_to_errno (GetLastError ()));
+  return TRACE_SYSRES (-1);
+}
+#endif /*!HAVE_W32CE_SYSTEM*/
+
+
+/* Fallback for pth_splice: Copy up to SIZE bytes from IN_FD to OUT_FD
+   using a bounce buffer.  If writing fails after some bytes have been
+   written, their number is returned; the remaining bytes could not be
+   delivered to OUT_FD anyway.  */
+static int
+copy_fd (int in_fd, int out_fd, size_t size)
+{
+  char buffer[4096];
+  int n, nwritten, total;
+
+  if (size > sizeof buffer)
+    size = sizeof buffer;
+  n = do_pth_read (in_fd, buffer, size);
+  for (total = 0; total < n; total += nwritten)
+    {
+      nwritten = do_pth_write (out_fd, buffer + total, n - total);
+      if (nwritten <= 0)
+        {
+          if (!nwritten)
+            set_errno (EIO);  /* Would loop forever.  */
+          if (DBG_ERROR)
+            _pth_debug (0, "pth_splice(0x%x): %d of %d bytes lost\n",
+                        in_fd, n - total, n);
+          return total? total : -1;
+        }
+    }
+  return n;
+}
+
+
+/* Move up to SIZE bytes from IN_FD to OUT_FD without passing them
+   through the caller.  Pipes created by pth_pipe are served directly
+   from the reader thread's buffer and a disk file is sent to a socket
+   using TransmitFile.  Returns the number of bytes moved, 0 on EOF
+   or -1 on error.  */
+int
+pth_splice_ev (int in_fd, int out_fd, size_t size, pth_event_t ev_extra)
+{
+  int n;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  if (_pth_get_reader_ev (in_fd) != INVALID_HANDLE_VALUE)
+    {
+      n = wait_for_fd (in_fd, 0, ev_extra);
+      if (!n)
+        n = _pth_io_splice (in_fd, out_fd, size);
+    }
+#ifndef HAVE_W32CE_SYSTEM
+  else if (_pth_get_writer_ev (out_fd) == INVALID_HANDLE_VALUE
+           && !is_socket_2 (in_fd)
+           && GetFileType ((HANDLE)in_fd) == FILE_TYPE_DISK
+           && is_socket_2 (out_fd))
+    {
+      n = wait_for_fd (out_fd, 1, ev_extra);
+      if (!n)
+        n = transmit_file (in_fd, out_fd, size);
+    }
+#endif /*!HAVE_W32CE_SYSTEM*/
+  else
+    {
+      /* We can only wait on sockets here; other handles would make
+         do_pth_wait wait for EV_EXTRA alone.  */
+      n = is_socket_2 (in_fd)? wait_for_fd (in_fd, 0, ev_extra) : 0;
+      if (!n)
+        n = copy_fd (in_fd, out_fd, size);
+    }
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return n;
+}
+
+
+int
+pth_splice (int in_fd, int out_fd, size_t size)
+{
+  return pth_splice_ev (in_fd, out_fd, size, NULL);
+}
+
+
+/* Wait until all data written to FD with pth_write has been handed
+   to the system.  This is only needed if write coalescing has been
+   enabled with PTH_CTRL_SETCOALESCE.  */
+int
+pth_flush (int fd)
+{
+  int rc;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  rc = _pth_io_flush (fd);
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return rc;
+}
+
+
+static void
+show_event_ring (const char *text, pth_event_t ev)
+{
+  pth_event_t r;
+
+  if (!ev)
+    {
+      _pth_debug (0, "show_event_ring(%s):  No ring\n", text);
+      return;
+    }
+
+  r = ev;
+  do
     {
       _pth_debug (0, "show_event_ring(%s): type=%d r=%p prev=%p next=%p\n",
                text, r->u_type, r, r->prev, r->next);
@@ -1348,6 +2166,7 @@ pth_select_ev (int nfd, fd_set *rfds, fd_set *wfds, fd_set *efds,
   do_pth_event_free (ev_time, PTH_FREE_THIS);
 
   leave_pth (__FUNCTION__);
+  test_cancel ();
   return rc;
 }
 
@@ -1389,439 +2208,2585 @@ pth_fdmode (int fd, int mode)
 }
 
 
-int
-pth_accept (int fd, struct sockaddr *addr, int *addrlen)
+#ifndef HAVE_W32CE_SYSTEM
+/* Pools of AcceptEx operations kept pending on listening sockets.
+   They are set up with pth_accept_prepost and used by pth_accept,
+   pth_accept_ev and pth_accept_many.  The list, the pools and their
+   operations are used between enter_pth and leave_pth and are thus
+   protected by ACCEPT_POOL_LOCK and not by the world lock.  A pool
+   with a non-zero BUSY count is not changed by pth_accept_prepost,
+   so the event handles of its operations stay valid while a waiter
+   has released the lock.  */
+#define MAX_ACCEPT_PREPOST 16
+#define ACCEPT_ADDRLEN     (sizeof (struct sockaddr_storage) + 16)
+
+/* Time in milliseconds we wait for a cancelled AcceptEx.  */
+#define ACCEPT_CANCEL_TIMEOUT 2000
+
+struct accept_op_s
 {
-  int rc;
+  OVERLAPPED ov;        /* The hEvent is a manual reset event.  */
+  SOCKET sock;          /* The accept socket or INVALID_SOCKET.  */
+  int pending;          /* True while AcceptEx is outstanding.  */
+  char addrbuf[2 * ACCEPT_ADDRLEN];
+};
 
-  implicit_init ();
-  enter_pth (__FUNCTION__);
-  rc = accept (fd, addr, addrlen);
-  leave_pth (__FUNCTION__);
-  return rc;
+struct accept_pool_s
+{
+  struct accept_pool_s *next;
+  int fd;               /* The listening socket.  */
+  int busy;             /* Number of threads using this pool.  */
+  int af, type, protocol;
+  int nops;
+  struct accept_op_s *ops[MAX_ACCEPT_PREPOST];
+};
+
+static struct accept_pool_s *accept_pools;
+
+typedef BOOL (WINAPI *cancel_io_ex_t) (HANDLE, LPOVERLAPPED);
+
+
+/* Must be called with ACCEPT_POOL_LOCK held.  */
+static struct accept_pool_s *
+find_accept_pool (int fd)
+{
+  struct accept_pool_s *pool;
+
+  for (pool = accept_pools; pool; pool = pool->next)
+    if (pool->fd == fd)
+      return pool;
+  return NULL;
 }
 
 
-int
-pth_accept_ev (int fd, struct sockaddr *addr, int *addrlen,
-               pth_event_t ev_extra)
+/* Return the pool of the listening socket FD with its busy count
+   incremented or NULL if FD has no pool.  The pool is released by
+   accept_pool_wait.  */
+static struct accept_pool_s *
+accept_pool_get (int fd)
 {
-  pth_key_t ev_key;
-  pth_event_t ev;
-  int rv;
-  int fdmode;
+  struct accept_pool_s *pool;
+
+  EnterCriticalSection (&accept_pool_lock);
+  pool = find_accept_pool (fd);
+  if (pool)
+    pool->busy++;
+  LeaveCriticalSection (&accept_pool_lock);
+  return pool;
+}
 
-  implicit_init ();
-  enter_pth (__FUNCTION__);
 
-  fdmode = pth_fdmode (fd, PTH_FDMODE_NONBLOCK);
-  if (fdmode == PTH_FDMODE_ERROR)
+/* Post an AcceptEx on the listening socket for OP.  */
+static int
+accept_op_post (struct accept_pool_s *pool, struct accept_op_s *op)
+{
+  DWORD nbytes;
+  int ec;
+
+  op->sock = socket (pool->af, pool->type, pool->protocol);
+  if (op->sock == INVALID_SOCKET)
     {
-      leave_pth (__FUNCTION__);
+      set_errno (map_wsa_to_errno (WSAGetLastError ()));
       return -1;
     }
 
-  ev = NULL;
-  while ((rv = accept (fd, addr, addrlen)) == -1 && 
-         (WSAGetLastError () == WSAEINPROGRESS || 
-          WSAGetLastError () == WSAEWOULDBLOCK))
+  ResetEvent (op->ov.hEvent);
+  op->ov.Internal = op->ov.InternalHigh = 0;
+  op->ov.Offset = op->ov.OffsetHigh = 0;
+  if (!AcceptEx ((SOCKET)pool->fd, op->sock, op->addrbuf, 0,
+                 ACCEPT_ADDRLEN, ACCEPT_ADDRLEN, &nbytes, &op->ov)
+      && (ec = (int) WSAGetLastError ()) != ERROR_IO_PENDING)
     {
-      if (!ev)
-        {
-          ev = do_pth_event (PTH_EVENT_FD|PTH_UNTIL_FD_READABLE|
-                             PTH_MODE_STATIC, &ev_key, fd);
-          if (!ev)
-            {
-              leave_pth (__FUNCTION__);
-              return -1;
-            }
-          if (ev_extra)
-            pth_event_concat (ev, ev_extra, NULL);
-        }
-      /* Wait until accept has a chance. */
-      do_pth_wait (ev);
-      if (ev_extra)
-        {
-          pth_event_isolate (ev);
-          if (ev && ev->status != PTH_STATUS_OCCURRED)
-            {
-#ifdef NO_PTH_MODE_STATIC
-	      do_pth_event_free (ev, PTH_FREE_THIS);
-#endif
-              pth_fdmode (fd, fdmode);
-              leave_pth (__FUNCTION__);
-              return -1;
-            }
-        }
+      if (DBG_ERROR)
+        _pth_debug (0, "pth_accept(0x%x): AcceptEx failed: ec=%d\n",
+                    pool->fd, ec);
+      closesocket (op->sock);
+      op->sock = INVALID_SOCKET;
+      set_errno (map_wsa_to_errno (ec));
+      return -1;
     }
-#ifdef NO_PTH_MODE_STATIC
-  if (ev)
-    do_pth_event_free (ev, PTH_FREE_THIS);
-#endif
-
-  pth_fdmode (fd, fdmode);
-  leave_pth (__FUNCTION__);
-  return rv;   
+  op->pending = 1;
+  return 0;
 }
 
 
-int
-pth_connect (int fd, struct sockaddr *name, int namelen)
+/* Abandon the operation OP of POOL and free it.  A pending AcceptEx
+   is cancelled and we wait at most ACCEPT_CANCEL_TIMEOUT for its
+   completion; if it does not complete the system still owns OP->OV
+   and OP is leaked instead of freed.  CancelIoEx is only available
+   since Vista, thus we look it up at runtime; without it we rely on
+   the closing of the accept socket.  Must be called with
+   ACCEPT_POOL_LOCK held.  */
+static void
+accept_op_release (struct accept_pool_s *pool, struct accept_op_s *op)
 {
-  int rc;
+  static cancel_io_ex_t cancel_io_ex;
+  static int initialized;
+  DWORD nbytes, flags;
 
-  implicit_init ();
-  enter_pth (__FUNCTION__);
-  rc = connect (fd, name, namelen);
-  leave_pth (__FUNCTION__);
-  return rc;
+  if (!initialized)
+    {
+      cancel_io_ex = (cancel_io_ex_t)
+        GetProcAddress (GetModuleHandleA ("kernel32.dll"), "CancelIoEx");
+      initialized = 1;
+    }
+
+  if (op->pending)
+    {
+      if (cancel_io_ex)
+        cancel_io_ex ((HANDLE)pool->fd, &op->ov);
+      closesocket (op->sock);
+      op->sock = INVALID_SOCKET;
+      if (WaitForSingleObject (op->ov.hEvent, ACCEPT_CANCEL_TIMEOUT)
+          != WAIT_OBJECT_0)
+        {
+          if (DBG_ERROR)
+            _pth_debug (0, "pth_accept_prepost(0x%x): AcceptEx did not "
+                        "complete - leaking it\n", pool->fd);
+          return;
+        }
+      WSAGetOverlappedResult ((SOCKET)pool->fd, &op->ov,
+                              &nbytes, FALSE, &flags);
+      op->pending = 0;
+    }
+  else if (op->sock != INVALID_SOCKET)
+    closesocket (op->sock);
+  if (op->ov.hEvent)
+    CloseHandle (op->ov.hEvent);
+  _pth_free (op);
 }
 
 
-int
-pth_mutex_release (pth_mutex_t *mutex)
+/* Store up to NFDS completed connections of POOL in FDS and post new
+   operations for all slots which are not pending.  The peer address
+   of the first connection is stored at ADDR.  Returns the number of
+   connections.  Must be called with ACCEPT_POOL_LOCK held.  */
+static int
+accept_pool_harvest (struct accept_pool_s *pool, int *fds, int nfds,
+                     struct sockaddr *addr, int *addrlen)
 {
-  int rc;
-
-  implicit_init ();
-  enter_pth (__FUNCTION__);
-
-  if (!ReleaseMutex (*mutex))
+  struct accept_op_s *op;
+  struct sockaddr *laddr, *raddr;
+  int llen, rlen;
+  SOCKET listener = (SOCKET)pool->fd;
+  DWORD nbytes, flags;
+  int i, n = 0;
+
+  for (i = 0; i < pool->nops; i++)
     {
-      char strerr[256];
-
-      if (DBG_ERROR)
-        _pth_debug (0, "pth_release_mutex %p failed: %s\n",
-                    *mutex, w32_strerror (strerr, sizeof strerr));
-      rc = FALSE;
+      op = pool->ops[i];
+      if (op->pending && n < nfds && HasOverlappedIoCompleted (&op->ov))
+        {
+          op->pending = 0;
+          if (!WSAGetOverlappedResult (listener, &op->ov,
+                                       &nbytes, FALSE, &flags))
+            {
+              /* The peer may have reset the connection before we
+                 could take it or, with ERROR_OPERATION_ABORTED, the
+                 thread which posted the operation has terminated.
+                 In any case the slot is posted again.  */
+              if (DBG_INFO)
+                _pth_debug (DEBUG_INFO, "pth_accept(0x%x): AcceptEx "
+                            "completed with ec=%d\n",
+                            pool->fd, (int)WSAGetLastError ());
+              closesocket (op->sock);
+              op->sock = INVALID_SOCKET;
+            }
+          else
+            {
+              setsockopt (op->sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+                          (char *)&listener, sizeof listener);
+              if (!n && addr && addrlen)
+                {
+                  GetAcceptExSockaddrs (op->addrbuf, 0,
+                                        ACCEPT_ADDRLEN, ACCEPT_ADDRLEN,
+                                        &laddr, &llen, &raddr, &rlen);
+                  if (rlen < *addrlen)
+                    *addrlen = rlen;
+                  memcpy (addr, raddr, *addrlen);
+                }
+              fds[n++] = (int)op->sock;
+              op->sock = INVALID_SOCKET;
+              _pth_io_account (pool->fd, 0, 0);
+            }
+        }
+      if (!op->pending)
+        accept_op_post (pool, op);
     }
-  else
-    rc = TRUE;
-
-  leave_pth (__FUNCTION__);
-  return rc;
+  return n;
 }
 
 
-int
-pth_mutex_acquire (pth_mutex_t *mutex, int tryonly, pth_event_t ev_extra)
+/* Wait for up to NFDS connections on the pool POOL which has been
+   obtained with accept_pool_get; the pool is released before
+   returning.  Each waiter uses its own events for the operations so
+   that several threads may wait on the same pool.  Must be called
+   between enter_pth and leave_pth.  */
+static int
+accept_pool_wait (struct accept_pool_s *pool, int *fds, int nfds,
+                  struct sockaddr *addr, int *addrlen, pth_event_t ev_extra)
 {
-  int code;
-  int rc;
-
-  implicit_init ();
-  enter_pth (__FUNCTION__);
+  HANDLE hds[MAX_ACCEPT_PREPOST];
+  pth_event_t evs[MAX_ACCEPT_PREPOST];
+  pth_event_t ring;
+  int i, nhds, n, occurred;
 
-  /* FIXME: ev_extra is not yet supported.  */
-  
-  code = WaitForSingleObject (*mutex, INFINITE);
-  switch (code) 
+  for (;;)
     {
-      case WAIT_FAILED:
+      EnterCriticalSection (&accept_pool_lock);
+      n = accept_pool_harvest (pool, fds, nfds, addr, addrlen);
+      nhds = 0;
+      if (!n)
+        for (i = 0; i < pool->nops; i++)
+          if (pool->ops[i]->pending)
+            hds[nhds++] = pool->ops[i]->ov.hEvent;
+      LeaveCriticalSection (&accept_pool_lock);
+      if (n)
+        break;
+      if (!nhds)
         {
-          char strerr[256];
-          
-          if (DBG_ERROR)
-            _pth_debug (0, "pth_mutex_acquire for %p failed: %s\n",
-                        *mutex, w32_strerror (strerr, sizeof strerr));
+          /* Posting failed for all slots; ERRNO is already set.  */
+          n = -1;
+          break;
         }
-        rc = FALSE;
-        break;
-        
-      case WAIT_OBJECT_0:
-        rc = TRUE;
-        break;
 
-      default:
-        if (DBG_ERROR)
-          _pth_debug (0, "WaitForSingleObject returned unexpected "
-                      "code %d for mutex %p\n",
-                      code, *mutex);
-        rc = FALSE;
-        break;
+      ring = NULL;
+      for (i = 0; i < nhds; i++)
+        {
+          evs[i] = do_pth_event (PTH_EVENT_HANDLE, hds[i]);
+          if (!evs[i])
+            break;
+          if (ring)
+            pth_event_concat (ring, evs[i], NULL);
+          else
+            ring = evs[i];
+        }
+      if (i < nhds)
+        {
+          while (i--)
+            {
+              pth_event_isolate (evs[i]);
+              do_pth_event_free (evs[i], PTH_FREE_THIS);
+            }
+          n = -1;
+          break;
+        }
+      if (ev_extra)
+        pth_event_concat (ring, ev_extra, NULL);
+
+      do_pth_wait (ring);
+
+      occurred = 0;
+      for (i = 0; i < nhds; i++)
+        {
+          if (evs[i]->status == PTH_STATUS_OCCURRED)
+            occurred = 1;
+          pth_event_isolate (evs[i]);
+          do_pth_event_free (evs[i], PTH_FREE_THIS);
+        }
+      if (!occurred)
+        {
+          set_errno (EINTR);
+          n = -1;
+          break;
+        }
     }
 
-  leave_pth (__FUNCTION__);
-  return rc;
+  EnterCriticalSection (&accept_pool_lock);
+  pool->busy--;
+  LeaveCriticalSection (&accept_pool_lock);
+  return n;
 }
 
 
-
+/* Keep COUNT AcceptEx operations pending on the listening socket FD.
+   With a COUNT of 0 the operations are cancelled.  Returns 0 on
+   success.  */
 int
-pth_mutex_init (pth_mutex_t *mutex)
+pth_accept_prepost (int fd, int count)
 {
-  SECURITY_ATTRIBUTES sa;
-  
+  struct accept_pool_s *pool, **pp;
+  struct accept_op_s *op;
+  WSAPROTOCOL_INFO info;
+  int len, rc = 0;
+
   implicit_init ();
   enter_pth (__FUNCTION__);
+  EnterCriticalSection (&accept_pool_lock);
 
-  memset (&sa, 0, sizeof sa);
-  sa.bInheritHandle = TRUE;
-  sa.lpSecurityDescriptor = NULL;
-  sa.nLength = sizeof sa;
-  *mutex = CreateMutex (&sa, FALSE, NULL);
-  if (!*mutex)
-   {
+  pool = find_accept_pool (fd);
+  if (count < 0 || count > MAX_ACCEPT_PREPOST)
+    {
+      set_errno (EINVAL);
+      rc = -1;
+      goto leave;
+    }
+  if (pool && pool->busy)
+    {
+      set_errno (EBUSY);
+      rc = -1;
+      goto leave;
+    }
+
+  if (!pool && count)
+    {
+      len = sizeof info;
+      if (getsockopt (fd, SOL_SOCKET, SO_PROTOCOL_INFO, (char*)&info, &len))
+        {
+          set_errno (map_wsa_to_errno (WSAGetLastError ()));
+          rc = -1;
+          goto leave;
+        }
+      pool = _pth_calloc (1, sizeof *pool);
+      if (!pool)
+        {
+          rc = -1;
+          goto leave;
+        }
+      pool->fd = fd;
+      pool->af = info.iAddressFamily;
+      pool->type = info.iSocketType;
+      pool->protocol = info.iProtocol;
+      pool->next = accept_pools;
+      accept_pools = pool;
+    }
+  if (!pool)
+    goto leave;
+
+  while (pool->nops > count)
+    accept_op_release (pool, pool->ops[--pool->nops]);
+  while (pool->nops < count)
+    {
+      op = _pth_calloc (1, sizeof *op);
+      if (!op)
+        {
+          rc = -1;
+          break;
+        }
+      op->sock = INVALID_SOCKET;
+      op->ov.hEvent = CreateEvent (NULL, TRUE, FALSE, NULL);
+      if (!op->ov.hEvent || accept_op_post (pool, op))
+        {
+          accept_op_release (pool, op);
+          rc = -1;
+          break;
+        }
+      pool->ops[pool->nops++] = op;
+    }
+
+  if (!pool->nops)
+    {
+      for (pp = &accept_pools; *pp != pool; pp = &(*pp)->next)
+        ;
+      *pp = pool->next;
+      _pth_free (pool);
+    }
+
+ leave:
+  LeaveCriticalSection (&accept_pool_lock);
+  leave_pth (__FUNCTION__);
+  return rc;
+}
+#else /*HAVE_W32CE_SYSTEM*/
+int
+pth_accept_prepost (int fd, int count)
+{
+  (void)fd;
+  (void)count;
+  set_errno (ENOSYS);  /* AcceptEx is not available.  */
+  return -1;
+}
+#endif /*HAVE_W32CE_SYSTEM*/
+
+
+int
+pth_accept (int fd, struct sockaddr *addr, int *addrlen)
+{
+#ifndef HAVE_W32CE_SYSTEM
+  struct accept_pool_s *pool;
+#endif
+  int rc;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+#ifndef HAVE_W32CE_SYSTEM
+  if ((pool = accept_pool_get (fd)))
+    {
+      if (accept_pool_wait (pool, &rc, 1, addr, addrlen, NULL) < 0)
+        rc = -1;
+    }
+  else
+#endif
+    {
+      rc = accept (fd, addr, addrlen);
+      if (rc != -1)
+        _pth_io_account (fd, 0, 0);
+    }
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return rc;
+}
+
+
+static int
+do_accept_ev (int fd, struct sockaddr *addr, int *addrlen,
+              pth_event_t ev_extra)
+{
+#ifndef HAVE_W32CE_SYSTEM
+  struct accept_pool_s *pool;
+#endif
+  pth_key_t ev_key;
+  pth_event_t ev;
+  int rv;
+  int fdmode;
+
+#ifndef HAVE_W32CE_SYSTEM
+  if ((pool = accept_pool_get (fd)))
+    {
+      if (accept_pool_wait (pool, &rv, 1, addr, addrlen, ev_extra) < 0)
+        rv = -1;
+      return rv;
+    }
+#endif
+
+  fdmode = pth_fdmode (fd, PTH_FDMODE_NONBLOCK);
+  if (fdmode == PTH_FDMODE_ERROR)
+    return -1;
+
+  ev = NULL;
+  while ((rv = accept (fd, addr, addrlen)) == -1 && 
+         (WSAGetLastError () == WSAEINPROGRESS || 
+          WSAGetLastError () == WSAEWOULDBLOCK))
+    {
+      if (!ev)
+        {
+          ev = do_pth_event (PTH_EVENT_FD|PTH_UNTIL_FD_READABLE|
+                             PTH_MODE_STATIC, &ev_key, fd);
+          if (!ev)
+            return -1;
+          if (ev_extra)
+            pth_event_concat (ev, ev_extra, NULL);
+        }
+      /* Wait until accept has a chance. */
+      do_pth_wait (ev);
+      if (ev_extra)
+        pth_event_isolate (ev);
+      if (ev->status != PTH_STATUS_OCCURRED
+          && (ev_extra || cancel_requested ()))
+        {
+#ifdef NO_PTH_MODE_STATIC
+          do_pth_event_free (ev, PTH_FREE_THIS);
+#endif
+          set_errno (EINTR);
+          pth_fdmode (fd, fdmode);
+          return -1;
+        }
+    }
+#ifdef NO_PTH_MODE_STATIC
+  if (ev)
+    do_pth_event_free (ev, PTH_FREE_THIS);
+#endif
+  if (rv != -1)
+    _pth_io_account (fd, 0, 0);
+
+  pth_fdmode (fd, fdmode);
+  return rv;   
+}
+
+
+int
+pth_accept_ev (int fd, struct sockaddr *addr, int *addrlen,
+               pth_event_t ev_extra)
+{
+  int rv;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+  rv = do_accept_ev (fd, addr, addrlen, ev_extra);
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return rv;
+}
+
+
+/* Wait for a connection on FD and return up to NFDS connected
+   sockets in FDS.  The peer address of the first connection is
+   stored at ADDR.  Returns the number of connections or -1 on
+   error.  */
+int
+pth_accept_many (int fd, int *fds, int nfds,
+                 struct sockaddr *addr, int *addrlen, pth_event_t ev_extra)
+{
+#ifndef HAVE_W32CE_SYSTEM
+  struct accept_pool_s *pool;
+#endif
+  int n, rv;
+  unsigned long val;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  if (!fds || nfds < 1)
+    {
+      set_errno (EINVAL);
+      n = -1;
+    }
+#ifndef HAVE_W32CE_SYSTEM
+  else if ((pool = accept_pool_get (fd)))
+    n = accept_pool_wait (pool, fds, nfds, addr, addrlen, ev_extra);
+#endif
+  else if ((rv = do_accept_ev (fd, addr, addrlen, ev_extra)) == -1)
+    n = -1;
+  else
+    {
+      /* Take what is already queued without waiting.  */
+      fds[0] = rv;
+      n = 1;
+      val = 1;
+      if (n < nfds && !ioctlsocket (fd, FIONBIO, &val))
+        {
+          while (n < nfds && (rv = accept (fd, NULL, NULL)) != -1)
+            {
+              _pth_io_account (fd, 0, 0);
+              fds[n++] = rv;
+            }
+          val = 0;
+          ioctlsocket (fd, FIONBIO, &val);
+        }
+    }
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return n;
+}
+
+
+int
+pth_connect (int fd, struct sockaddr *name, int namelen)
+{
+  return pth_connect_ev (fd, name, namelen, NULL);
+}
+
+
+/* Connect the socket FD to NAME.  The connect is started in
+   non-blocking mode and we wait for the FD_CONNECT network event so
+   that EV_EXTRA may be used to implement a timeout; in this case -1
+   is returned with ERRNO set to EINTR and the connect is abandoned.
+   The socket is set back to blocking mode in all cases.  */
+int
+pth_connect_ev (int fd, struct sockaddr *name, int namelen,
+                pth_event_t ev_extra)
+{
+  static pth_key_t ev_key = PTH_KEY_INIT;
+  pth_event_t ev;
+  WSAEVENT sockevent;
+  WSANETWORKEVENTS ne;
+  unsigned long val;
+  int rc, ec;
+  TRACE_BEG (DEBUG_INFO, "pth_connect_ev", fd);
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  sockevent = WSACreateEvent ();
+  if (sockevent == WSA_INVALID_EVENT)
+    {
+      set_errno (map_wsa_to_errno (WSAGetLastError ()));
+      rc = -1;
+      goto leave;
+    }
+  /* This also switches the socket into non-blocking mode.  */
+  if (WSAEventSelect (fd, sockevent, FD_CONNECT))
+    {
+      set_errno (map_wsa_to_errno (WSAGetLastError ()));
+      WSACloseEvent (sockevent);
+      rc = -1;
+      goto leave;
+    }
+
+  rc = connect (fd, name, namelen);
+  if (rc == SOCKET_ERROR)
+    {
+      ec = (int) WSAGetLastError ();
+      if (ec != WSAEWOULDBLOCK)
+        set_errno (map_wsa_to_errno (ec));
+      else
+        {
+          TRACE_LOG ("connect in progress");
+          ev = do_pth_event (PTH_EVENT_HANDLE | PTH_MODE_STATIC,
+                             &ev_key, sockevent);
+          if (!ev)
+            goto clear;
+          if (ev_extra)
+            pth_event_concat (ev, ev_extra, NULL);
+
+          do_pth_wait (ev);
+
+          if (ev_extra)
+            pth_event_isolate (ev);
+          if (ev->status != PTH_STATUS_OCCURRED)
+            set_errno (EINTR);
+          else if (WSAEnumNetworkEvents (fd, NULL, &ne))
+            set_errno (map_wsa_to_errno (WSAGetLastError ()));
+          else if (!(ne.lNetworkEvents & FD_CONNECT))
+            set_errno (EIO);
+          else if ((ec = ne.iErrorCode[FD_CONNECT_BIT]))
+            {
+              TRACE_LOG1 ("connect failed: ec=%d", ec);
+              set_errno (map_wsa_to_errno (ec));
+            }
+          else
+            rc = 0;
+#ifdef NO_PTH_MODE_STATIC
+          do_pth_event_free (ev, PTH_FREE_THIS);
+#endif
+        }
+    }
+
+ clear:
+  WSAEventSelect (fd, NULL, 0);
+  WSACloseEvent (sockevent);
+  val = 0;
+  ioctlsocket (fd, FIONBIO, &val);
+
+ leave:
+  TRACE_SYSRES (rc);
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return rc;
+}
+
+
+/* Common code for pth_recv, pth_recvfrom, pth_send and pth_sendto.
+   Runs the socket operation in non-blocking mode and waits for FD to
+   become readable (or writeable for SENDING) until it succeeds.  If
+   ADDR is not NULL recvfrom or sendto is used.  Returns the result of
+   the socket call or -1 with ERRNO set; if an event from EV_EXTRA
+   occurred ERRNO is EINTR.  */
+static int
+do_socket_io (int fd, int sending, void *buffer, size_t size, int flags,
+              struct sockaddr *addr, int *addrlen, pth_event_t ev_extra)
+{
+  int n;
+  int fdmode;
+  int ec;
+
+  TRACE_BEG2 (DEBUG_INFO, "do_socket_io", fd, "%s size=%d",
+              sending? "send":"recv", (int)size);
+
+  fdmode = pth_fdmode (fd, PTH_FDMODE_NONBLOCK);
+  if (fdmode == PTH_FDMODE_ERROR)
+    {
+      set_errno (map_wsa_to_errno (WSAGetLastError ()));
+      return TRACE_SYSRES (-1);
+    }
+
+  for (;;)
+    {
+      if (sending && addr)
+        n = sendto (fd, buffer, size, flags, addr, *addrlen);
+      else if (sending)
+        n = send (fd, buffer, size, flags);
+      else if (addr)
+        n = recvfrom (fd, buffer, size, flags, addr, addrlen);
+      else
+        n = recv (fd, buffer, size, flags);
+      if (n != SOCKET_ERROR)
+        break;
+      ec = (int) WSAGetLastError ();
+      if (ec != WSAEWOULDBLOCK && ec != WSAEINPROGRESS)
+        {
+          if (DBG_ERROR)
+            _pth_debug (0, "pth_%s(0x%x) failed: ec=%d\n",
+                        sending? "send":"recv", fd, ec);
+          set_errno (map_wsa_to_errno (ec));
+          break;
+        }
+      if (wait_for_fd (fd, sending, ev_extra))
+        break;
+    }
+  _pth_io_account (fd, sending, n);
+
+  pth_fdmode (fd, fdmode);
+  return TRACE_SYSRES (n);
+}
+
+
+int
+pth_recv_ev (int fd, void *buffer, size_t size, int flags,
+             pth_event_t ev_extra)
+{
+  int n;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  n = do_socket_io (fd, 0, buffer, size, flags, NULL, NULL, ev_extra);
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return n;
+}
+
+
+int
+pth_recv (int fd, void *buffer, size_t size, int flags)
+{
+  return pth_recv_ev (fd, buffer, size, flags, NULL);
+}
+
+
+int
+pth_recvfrom_ev (int fd, void *buffer, size_t size, int flags,
+                 struct sockaddr *from, int *fromlen, pth_event_t ev_extra)
+{
+  int n;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  if (!from || !fromlen)
+    {
+      set_errno (EINVAL);
+      n = -1;
+    }
+  else
+    n = do_socket_io (fd, 0, buffer, size, flags, from, fromlen, ev_extra);
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return n;
+}
+
+
+int
+pth_recvfrom (int fd, void *buffer, size_t size, int flags,
+              struct sockaddr *from, int *fromlen)
+{
+  return pth_recvfrom_ev (fd, buffer, size, flags, from, fromlen, NULL);
+}
+
+
+int
+pth_send_ev (int fd, const void *buffer, size_t size, int flags,
+             pth_event_t ev_extra)
+{
+  int n;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  n = do_socket_io (fd, 1, (void*)buffer, size, flags, NULL, NULL, ev_extra);
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return n;
+}
+
+
+int
+pth_send (int fd, const void *buffer, size_t size, int flags)
+{
+  return pth_send_ev (fd, buffer, size, flags, NULL);
+}
+
+
+int
+pth_sendto_ev (int fd, const void *buffer, size_t size, int flags,
+               const struct sockaddr *to, int tolen, pth_event_t ev_extra)
+{
+  int n;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+
+  if (!to)
+    {
+      set_errno (EINVAL);
+      n = -1;
+    }
+  else
+    n = do_socket_io (fd, 1, (void*)buffer, size, flags,
+                      (struct sockaddr *)to, &tolen, ev_extra);
+
+  leave_pth (__FUNCTION__);
+  test_cancel ();
+  return n;
+}
+
+
+int
+pth_sendto (int fd, const void *buffer, size_t size, int flags,
+            const struct sockaddr *to, int tolen)
+{
+  return pth_sendto_ev (fd, buffer, size, flags, to, tolen, NULL);
+}
+
+
+/* The mutex object.  A pth_mutex_t holds a pointer to it.  STATE is
+   0 if the mutex is free, 1 if it is locked and 2 if it is locked and
+   other threads may be waiting for it.  The uncontended case is thus
+   handled with one interlocked operation and without entering pth;
+   only a thread which needs to wait releases the world lock and
+   blocks on the WAKEUP event.  OWNER and COUNT implement the
+   recursive locking of GNU Pth.  */
+struct mutex_s
+{
+  volatile LONG state;
+  volatile DWORD owner;    /* Thread id of the owner or 0.  */
+  int count;               /* Recursion count, only used by the owner.  */
+  int spin;                /* Average spins which got us the lock in
+                              units of 1/8 so that small averages do
+                              not truncate to 0.  This is only a hint
+                              and updated without locking.  */
+  HANDLE volatile wakeup;  /* Auto-reset event, created on demand.  */
+};
+
+#define MUTEX_OF(m)  ((struct mutex_s *)*(m))
+
+
+/* Return the mutex object of MUTEX.  A mutex initialized with
+   PTH_MUTEX_INIT is allocated here on first use; if two threads race
+   for it the loser frees its object.  */
+static struct mutex_s *
+mutex_get (pth_mutex_t *mutex)
+{
+  struct mutex_s *m;
+
+  m = MUTEX_OF (mutex);
+  if (!m)
+    {
+      m = _pth_calloc (1, sizeof *m);
+      if (!m)
+        return NULL;
+      if (InterlockedCompareExchangePointer ((PVOID volatile *)mutex,
+                                             m, NULL))
+        {
+          _pth_free (m);
+          m = MUTEX_OF (mutex);
+        }
+    }
+  return m;
+}
+
+
+/* Return the auto-reset event stored at SLOT, creating it if
+   needed.  */
+static HANDLE
+lazy_event (HANDLE volatile *slot)
+{
+  HANDLE h;
+
+  if (!*slot)
+    {
+      h = CreateEvent (NULL, FALSE, FALSE, NULL);
+      if (!h)
+        return NULL;
+      if (InterlockedCompareExchangePointer ((PVOID volatile *)slot,
+                                             h, NULL))
+        CloseHandle (h);  /* Another thread was faster.  */
+    }
+  return *slot;
+}
+
+
+/* Wait until the object HD is signaled or, if EV_EXTRA is not NULL,
+   one of its events occurred.  Returns 0 if HD was signaled or -1
+   with ERRNO set to EINTR.  The wait is a cancellation point: It is
+   also interrupted by a cancellation request, after which the caller
+   shall undo its announcement and call test_cancel once it is back
+   from leave_pth.  Must be called between enter_pth and
+   leave_pth.  */
+static int
+wait_for_handle (HANDLE hd, pth_event_t ev_extra)
+{
+  pth_event_t ev;
+  int rc;
+
+  if (!ev_extra && !cancel_enabled ())
+    {
+      WaitForSingleObject (hd, INFINITE);
+      return 0;
+    }
+
+  ev = do_pth_event (PTH_EVENT_HANDLE, hd);
+  if (!ev)
+    return -1;
+  ev->flags |= EVENT_FLAG_NO_RESET;
+  if (ev_extra)
+    pth_event_concat (ev, ev_extra, NULL);
+
+  do_pth_wait_ex (ev, 1);
+
+  if (ev_extra)
+    pth_event_isolate (ev);
+  if (ev->status == PTH_STATUS_OCCURRED)
+    rc = 0;
+  else
+    {
+      set_errno (EINTR);
+      rc = -1;
+    }
+  do_pth_event_free (ev, PTH_FREE_THIS);
+  return rc;
+}
+
+
+/* Spin for a while in the hope that the holder of M releases it
+   soon.  Returns true if we got the mutex.  The budget follows the
+   number of spins needed by recent successful attempts, so that
+   mutexes held for long stop spinning.  */
+static int
+mutex_spin (struct mutex_s *m)
+{
+  int cnt, max;
+
+  if (ncpus < 2)
+    return 0;
+
+  max = m->spin / 4 + MUTEX_SPIN_MIN;  /* Twice the average.  */
+  if (max > MUTEX_SPIN_MAX)
+    max = MUTEX_SPIN_MAX;
+  for (cnt = 0; cnt < max; cnt++)
+    {
+      if (!m->state && !InterlockedCompareExchange (&m->state, 1, 0))
+        {
+          m->spin += cnt - m->spin / 8;
+          return 1;
+        }
+      YieldProcessor ();
+    }
+  m->spin -= m->spin / 4;
+  return 0;
+}
+
+
+/* Wait for the mutex M.  If EV_EXTRA is not NULL, give up with
+   EINTR as soon as one of its events occurred.  */
+static int
+mutex_lock_slow (struct mutex_s *m, pth_event_t ev_extra)
+{
+  int rc = 0;
+
+  HANDLE wakeup;
+
+  wakeup = lazy_event (&m->wakeup);
+  if (!wakeup)
+    {
+      set_errno (map_w32_to_errno (GetLastError ()));
+      return -1;
+    }
+
+  enter_pth (__FUNCTION__);
+  /* The holder can only release M while we are outside of the world
+     lock, thus spin after entering pth.  */
+  if (mutex_spin (m))
+    {
+      leave_pth (__FUNCTION__);
+      return 0;
+    }
+  /* Announce that we are waiting; if the mutex was free in the
+     meantime we own it now.  Giving up leaves the state at 2, which
+     merely costs the next release a spurious SetEvent.  */
+  while (InterlockedExchange (&m->state, 2) != 0)
+    if (wait_for_handle (wakeup, ev_extra))
+      {
+        rc = -1;
+        break;
+      }
+  leave_pth (__FUNCTION__);
+  if (rc)
+    test_cancel ();
+  return rc;
+}
+
+
+int
+pth_mutex_release (pth_mutex_t *mutex)
+{
+  struct mutex_s *m;
+
+  implicit_init ();
+
+  m = MUTEX_OF (mutex);
+  if (!m || m->owner != GetCurrentThreadId ())
+    {
+      if (DBG_ERROR)
+        _pth_debug (0, "pth_release_mutex %p: not owner\n", m);
+      set_errno (EPERM);
+      return FALSE;
+    }
+  if (--m->count)
+    return TRUE;
+
+  m->owner = 0;
+  if (InterlockedExchange (&m->state, 0) == 2)
+    SetEvent (m->wakeup);
+  return TRUE;
+}
+
+
+int
+pth_mutex_acquire (pth_mutex_t *mutex, int tryonly, pth_event_t ev_extra)
+{
+  struct mutex_s *m;
+  DWORD self;
+
+  implicit_init ();
+
+  m = mutex_get (mutex);
+  if (!m)
+    return FALSE;
+
+  self = GetCurrentThreadId ();
+  if (m->owner == self)
+    {
+      m->count++;
+      return TRUE;
+    }
+
+  if (InterlockedCompareExchange (&m->state, 1, 0) != 0)
+    {
+      if (tryonly)
+        {
+          set_errno (EBUSY);
+          return FALSE;
+        }
+      if (mutex_lock_slow (m, ev_extra))
+        {
+          if (DBG_ERROR)
+            _pth_debug (0, "pth_mutex_acquire for %p failed\n", m);
+          return FALSE;
+        }
+    }
+  m->owner = self;
+  m->count = 1;
+  return TRUE;
+}
+
+
+
+int
+pth_mutex_init (pth_mutex_t *mutex)
+{
+  struct mutex_s *m;
+
+  implicit_init ();
+
+  m = _pth_calloc (1, sizeof *m);
+  if (!m)
+    return FALSE;
+  *mutex = (pth_mutex_t)m;
+  return TRUE;
+}
+
+
+/* Destroy the mutex MUTEX.  */
+int
+pth_mutex_destroy (pth_mutex_t *mutex)
+{
+  struct mutex_s *m;
+
+  implicit_init ();
+
+  m = MUTEX_OF (mutex);
+  if (m)
+    {
+      if (m->wakeup)
+        CloseHandle (m->wakeup);
+      _pth_free (m);
+      *mutex = NULL;
+    }
+  return TRUE;
+}
+
+
+/* The read-write lock object.  STATE is the number of readers, -1 if
+   a writer holds the lock or 0 if it is free.  Waiting writers take
+   precedence over new readers.  Readers and writers wait on separate
+   auto-reset events; a releasing thread wakes one writer if any is
+   waiting and otherwise one reader, which wakes the next reader after
+   it got the lock.  The write lock is recursive like a mutex.  A
+   thread which already holds a read lock is not held back by waiting
+   writers, so that it may take read locks recursively; for this each
+   thread counts the read locks it holds per rwlock.  */
+struct rwlock_s
+{
+  volatile LONG state;
+  volatile LONG readers_waiting;
+  volatile LONG writers_waiting;
+  volatile DWORD owner;         /* Thread id of the writer or 0.  */
+  int count;                    /* Recursion count of the writer.  */
+  HANDLE volatile readers_ev;
+  HANDLE volatile writers_ev;
+};
+
+#define RWLOCK_OF(rw)  ((struct rwlock_s *)*(rw))
+
+
+/* Return the object of RWLOCK, allocating it for a lock initialized
+   with PTH_RWLOCK_INIT.  */
+static struct rwlock_s *
+rwlock_get (pth_rwlock_t *rwlock)
+{
+  struct rwlock_s *rw;
+
+  rw = RWLOCK_OF (rwlock);
+  if (!rw)
+    {
+      rw = _pth_calloc (1, sizeof *rw);
+      if (!rw)
+        return NULL;
+      if (InterlockedCompareExchangePointer ((PVOID volatile *)rwlock,
+                                             rw, NULL))
+        {
+          _pth_free (rw);
+          rw = RWLOCK_OF (rwlock);
+        }
+    }
+  return rw;
+}
+
+
+/* Try to take RW for reading.  If HOLDING is set the caller already
+   holds a read lock and ignores waiting writers.  */
+static int
+rwlock_try_read (struct rwlock_s *rw, int holding)
+{
+  LONG n;
+
+  for (;;)
+    {
+      n = rw->state;
+      if (n < 0 || (rw->writers_waiting && !holding))
+        return 0;
+      if (InterlockedCompareExchange (&rw->state, n + 1, n) == n)
+        return 1;
+    }
+}
+
+
+/* Return the entry counting the read locks of the calling thread TI
+   on RW.  If CREATE is set a missing entry is added with a count of
+   0; NULL is then only returned with ERRNO set to ENOMEM.  */
+static struct rdlock_s *
+rdlock_find (struct thread_info_s *ti, struct rwlock_s *rw, int create)
+{
+  struct rdlock_s *rl;
+
+  for (rl = ti->rdlocks; rl; rl = rl->next)
+    if (rl->rw == rw)
+      return rl;
+  if (!create)
+    return NULL;
+  rl = _pth_calloc (1, sizeof *rl);
+  if (!rl)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  rl->rw = rw;
+  rl->next = ti->rdlocks;
+  ti->rdlocks = rl;
+  return rl;
+}
+
+
+/* Remove the entry RL from the read locks of the calling thread
+   TI.  */
+static void
+rdlock_drop (struct thread_info_s *ti, struct rdlock_s *rl)
+{
+  struct rdlock_s **p;
+
+  for (p = &ti->rdlocks; *p; p = &(*p)->next)
+    if (*p == rl)
+      {
+        *p = rl->next;
+        _pth_free (rl);
+        return;
+      }
+}
+
+
+static int
+rwlock_try_write (struct rwlock_s *rw)
+{
+  return !InterlockedCompareExchange (&rw->state, -1, 0);
+}
+
+
+/* Wake up a waiter after RW became free.  */
+static void
+rwlock_wake (struct rwlock_s *rw)
+{
+  if (rw->writers_waiting)
+    SetEvent (rw->writers_ev);
+  else if (rw->readers_waiting)
+    SetEvent (rw->readers_ev);
+}
+
+
+/* Wait for RW as a reader or, with WRITER set, as a writer.  HOLDING
+   is passed to rwlock_try_read.  */
+static int
+rwlock_wait (struct rwlock_s *rw, int writer, int holding,
+             pth_event_t ev_extra)
+{
+  volatile LONG *waiting;
+  HANDLE hd;
+  int rc;
+
+  if (writer)
+    {
+      hd = lazy_event (&rw->writers_ev);
+      waiting = &rw->writers_waiting;
+    }
+  else
+    {
+      hd = lazy_event (&rw->readers_ev);
+      waiting = &rw->readers_waiting;
+    }
+  if (!hd)
+    {
+      set_errno (map_w32_to_errno (GetLastError ()));
+      return -1;
+    }
+
+  enter_pth (__FUNCTION__);
+  /* Announce ourself before trying again so that a release in the
+     meantime will signal the event.  */
+  InterlockedIncrement (waiting);
+  for (;;)
+    {
+      if (writer? rwlock_try_write (rw) : rwlock_try_read (rw, holding))
+        {
+          rc = 0;
+          break;
+        }
+      if (wait_for_handle (hd, ev_extra))
+        {
+          rc = -1;
+          break;
+        }
+    }
+  InterlockedDecrement (waiting);
+
+  if (!rc && !writer)
+    {
+      /* Let the next reader in as well.  */
+      if (rw->readers_waiting && !rw->writers_waiting)
+        SetEvent (rw->readers_ev);
+    }
+  else if (rc && writer)
+    {
+      /* We gave up; readers held back by us may now proceed.  */
+      if (!rw->writers_waiting && rw->state >= 0 && rw->readers_waiting)
+        SetEvent (rw->readers_ev);
+    }
+  leave_pth (__FUNCTION__);
+  if (rc)
+    test_cancel ();
+  return rc;
+}
+
+
+int
+pth_rwlock_init (pth_rwlock_t *rwlock)
+{
+  struct rwlock_s *rw;
+
+  implicit_init ();
+
+  rw = _pth_calloc (1, sizeof *rw);
+  if (!rw)
+    return FALSE;
+  *rwlock = (pth_rwlock_t)rw;
+  return TRUE;
+}
+
+
+int
+pth_rwlock_acquire (pth_rwlock_t *rwlock, int op, int tryonly,
+                    pth_event_t ev_extra)
+{
+  struct rwlock_s *rw;
+  struct thread_info_s *ti;
+  struct rdlock_s *rl = NULL;
+  DWORD self;
+  int holding;
+
+  implicit_init ();
+
+  rw = rwlock_get (rwlock);
+  if (!rw)
+    return FALSE;
+
+  self = GetCurrentThreadId ();
+  if (rw->owner == self)
+    {
+      /* The writer may lock again in either mode.  */
+      rw->count++;
+      return TRUE;
+    }
+
+  if (op == PTH_RWLOCK_RD)
+    {
+      ti = current_thread_info ();
+      if (ti && !(rl = rdlock_find (ti, rw, 1)))
+        return FALSE;
+      holding = rl && rl->count;
+      if (!rwlock_try_read (rw, holding))
+        {
+          if (tryonly)
+            set_errno (EBUSY);
+          if (tryonly || rwlock_wait (rw, 0, holding, ev_extra))
+            {
+              if (rl && !rl->count)
+                rdlock_drop (ti, rl);
+              return FALSE;
+            }
+        }
+      if (rl)
+        rl->count++;
+      return TRUE;
+    }
+
+  if (!rwlock_try_write (rw))
+    {
+      if (tryonly)
+        {
+          set_errno (EBUSY);
+          return FALSE;
+        }
+      if (rwlock_wait (rw, 1, 0, ev_extra))
+        return FALSE;
+    }
+  rw->owner = self;
+  rw->count = 1;
+  return TRUE;
+}
+
+
+int
+pth_rwlock_release (pth_rwlock_t *rwlock)
+{
+  struct rwlock_s *rw;
+  struct thread_info_s *ti;
+  struct rdlock_s *rl;
+  LONG n;
+
+  implicit_init ();
+
+  rw = RWLOCK_OF (rwlock);
+  if (!rw)
+    {
+      set_errno (EPERM);
+      return FALSE;
+    }
+
+  if (rw->owner == GetCurrentThreadId ())
+    {
+      if (--rw->count)
+        return TRUE;
+      rw->owner = 0;
+      InterlockedExchange (&rw->state, 0);
+      rwlock_wake (rw);
+      return TRUE;
+    }
+
+  for (;;)
+    {
+      n = rw->state;
+      if (n <= 0)
+        {
+          set_errno (EPERM);
+          return FALSE;
+        }
+      if (InterlockedCompareExchange (&rw->state, n - 1, n) == n)
+        break;
+    }
+  ti = current_thread_info ();
+  if (ti && (rl = rdlock_find (ti, rw, 0)) && !--rl->count)
+    rdlock_drop (ti, rl);
+  if (n == 1)
+    rwlock_wake (rw);
+  return TRUE;
+}
+
+
+/* Return the semaphore object stored at SLOT, creating it if
+   needed.  Unlike an event a semaphore can wake a given number of
+   waiters at once.  */
+static HANDLE
+lazy_semaphore (HANDLE volatile *slot)
+{
+  HANDLE h;
+
+  if (!*slot)
+    {
+      h = CreateSemaphore (NULL, 0, LONG_MAX, NULL);
+      if (!h)
+        return NULL;
+      if (InterlockedCompareExchangePointer ((PVOID volatile *)slot,
+                                             h, NULL))
+        CloseHandle (h);  /* Another thread was faster.  */
+    }
+  return *slot;
+}
+
+
+/* The counting semaphore object.  COUNT is taken with interlocked
+   operations; only if it is zero a thread waits on the kernel
+   semaphore WAKEUP.  A release passes at most as many tokens to
+   WAKEUP as there are waiters.  */
+struct sem_s
+{
+  volatile LONG count;
+  volatile LONG waiting;
+  HANDLE volatile wakeup;
+};
+
+#define SEM_OF(s)  ((struct sem_s *)*(s))
+
+
+static int
+sem_try (struct sem_s *sem)
+{
+  LONG n;
+
+  for (;;)
+    {
+      n = sem->count;
+      if (n <= 0)
+        return 0;
+      if (InterlockedCompareExchange (&sem->count, n - 1, n) == n)
+        return 1;
+    }
+}
+
+
+int
+pth_sem_init (pth_sem_t *semaphore, unsigned int value)
+{
+  struct sem_s *sem;
+
+  implicit_init ();
+
+  if (value > LONG_MAX)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  sem = _pth_calloc (1, sizeof *sem);
+  if (!sem)
+    return FALSE;
+  sem->count = value;
+  *semaphore = (pth_sem_t)sem;
+  return TRUE;
+}
+
+
+/* Decrement the semaphore SEMAPHORE, waiting until its value is
+   positive.  If TRYONLY is set fail with EBUSY instead of waiting.
+   If EV_EXTRA is not NULL, give up with EINTR as soon as one of its
+   events occurred.  */
+int
+pth_sem_acquire (pth_sem_t *semaphore, int tryonly, pth_event_t ev_extra)
+{
+  struct sem_s *sem;
+  HANDLE wakeup;
+  int rc = 0;
+
+  implicit_init ();
+
+  sem = SEM_OF (semaphore);
+  if (!sem)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  if (sem_try (sem))
+    return TRUE;
+  if (tryonly)
+    {
+      set_errno (EBUSY);
+      return FALSE;
+    }
+
+  wakeup = lazy_semaphore (&sem->wakeup);
+  if (!wakeup)
+    {
+      set_errno (map_w32_to_errno (GetLastError ()));
+      return FALSE;
+    }
+
+  enter_pth (__FUNCTION__);
+  /* Announce ourself before trying again so that a release in the
+     meantime passes a token to us.  */
+  InterlockedIncrement (&sem->waiting);
+  while (!sem_try (sem))
+    if (wait_for_handle (wakeup, ev_extra))
+      {
+        rc = -1;
+        break;
+      }
+  InterlockedDecrement (&sem->waiting);
+  leave_pth (__FUNCTION__);
+  if (rc)
+    test_cancel ();
+  return rc? FALSE : TRUE;
+}
+
+
+/* Increment the semaphore SEMAPHORE by COUNT and wake up that many
+   waiters.  */
+int
+pth_sem_release (pth_sem_t *semaphore, unsigned int count)
+{
+  struct sem_s *sem;
+  LONG n;
+
+  implicit_init ();
+
+  sem = SEM_OF (semaphore);
+  if (!sem || !count || count > LONG_MAX)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  InterlockedExchangeAdd (&sem->count, (LONG)count);
+  n = sem->waiting;
+  if (n > (LONG)count)
+    n = count;
+  /* A token may arrive after its waiter gave up; the next waiter then
+     just finds the count empty and waits again.  */
+  if (n > 0 && sem->wakeup)
+    ReleaseSemaphore (sem->wakeup, n, NULL);
+  return TRUE;
+}
+
+
+/* Destroy the semaphore SEMAPHORE.  */
+int
+pth_sem_destroy (pth_sem_t *semaphore)
+{
+  struct sem_s *sem;
+
+  implicit_init ();
+
+  sem = SEM_OF (semaphore);
+  if (sem)
+    {
+      if (sem->wakeup)
+        CloseHandle (sem->wakeup);
+      _pth_free (sem);
+      *semaphore = NULL;
+    }
+  return TRUE;
+}
+
+
+/* The barrier object.  REMAINING and CYCLE are only changed with the
+   world lock held.  Waiters of a cycle sleep on the kernel semaphore
+   selected by the parity of the cycle, so that a thread which already
+   reached the barrier of the next cycle can't take a token meant for
+   a waiter of the current cycle.  */
+struct barrier_s
+{
+  int threshold;
+  int remaining;
+  volatile LONG cycle;
+  HANDLE volatile wakeup[2];
+};
+
+#define BARRIER_OF(b)  ((struct barrier_s *)*(b))
+
+
+int
+pth_barrier_init (pth_barrier_t *barrier, int threshold)
+{
+  struct barrier_s *b;
+
+  implicit_init ();
+
+  if (threshold <= 0)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  b = _pth_calloc (1, sizeof *b);
+  if (!b)
+    return FALSE;
+  b->threshold = b->remaining = threshold;
+  *barrier = (pth_barrier_t)b;
+  return TRUE;
+}
+
+
+/* Wait until THRESHOLD threads reached the barrier BARRIER.  Returns
+   PTH_BARRIER_TAILLIGHT for the last thread, which wakes up the
+   others, PTH_BARRIER_HEADLIGHT for the first thread, TRUE for all
+   other threads and FALSE on error.  */
+int
+pth_barrier_reach (pth_barrier_t *barrier)
+{
+  struct barrier_s *b;
+  HANDLE wakeup;
+  LONG cycle;
+  int rc;
+
+  implicit_init ();
+
+  b = BARRIER_OF (barrier);
+  if (!b)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+
+  cycle = b->cycle;
+  wakeup = lazy_semaphore (&b->wakeup[cycle & 1]);
+  if (!wakeup)
+    {
+      set_errno (map_w32_to_errno (GetLastError ()));
+      return FALSE;
+    }
+
+  if (!--b->remaining)
+    {
+      b->remaining = b->threshold;
+      InterlockedIncrement (&b->cycle);
+      if (b->threshold > 1)
+        ReleaseSemaphore (wakeup, b->threshold - 1, NULL);
+      return PTH_BARRIER_TAILLIGHT;
+    }
+  rc = (b->remaining == b->threshold - 1)? PTH_BARRIER_HEADLIGHT : TRUE;
+
+  enter_pth (__FUNCTION__);
+  while (b->cycle == cycle)
+    WaitForSingleObject (wakeup, INFINITE);
+  leave_pth (__FUNCTION__);
+  return rc;
+}
+
+
+/* Destroy the barrier BARRIER.  No thread may wait on it.  */
+int
+pth_barrier_destroy (pth_barrier_t *barrier)
+{
+  struct barrier_s *b;
+
+  implicit_init ();
+
+  b = BARRIER_OF (barrier);
+  if (b)
+    {
+      if (b->wakeup[0])
+        CloseHandle (b->wakeup[0]);
+      if (b->wakeup[1])
+        CloseHandle (b->wakeup[1]);
+      _pth_free (b);
+      *barrier = NULL;
+    }
+  return TRUE;
+}
+
+
+/* States of a pth_once_t.  */
+#define ONCE_INIT    0
+#define ONCE_RUNNING 1
+#define ONCE_DONE    2
+
+/* A thread waiting for another thread to finish a pth_once.  The
+   list of waiters is only accessed with the world lock held.  */
+struct once_wait_s
+{
+  struct once_wait_s *next;
+  pth_once_t *once;
+  HANDLE ev;
+};
+static struct once_wait_s *once_waiters;
+
+
+/* Set ONCE to STATE and wake up all threads waiting for it.  Must be
+   called with the world lock held.  */
+static void
+once_finish (pth_once_t *once, LONG state)
+{
+  struct once_wait_s **wp;
+
+  InterlockedExchange ((volatile LONG *)once, state);
+  for (wp = &once_waiters; *wp; )
+    if ((*wp)->once == once)
+      {
+        SetEvent ((*wp)->ev);
+        *wp = (*wp)->next;
+      }
+    else
+      wp = &(*wp)->next;
+}
+
+
+/* Cleanup handler active while a constructor of pth_once runs.  If
+   the thread is cancelled or exits in the constructor, ONCE is reset
+   so that one of the waiters runs the constructor again.  */
+static void
+once_abandon (void *arg)
+{
+  once_finish (arg, ONCE_INIT);
+}
+
+
+/* Call CONSTRUCTOR with ARG if this is the first call for ONCE.  All
+   other callers return after the constructor has returned.  If the
+   thread running the constructor is cancelled or exits, another
+   caller runs the constructor.  */
+int
+pth_once (pth_once_t *once, void (*constructor)(void *), void *arg)
+{
+  struct once_wait_s wait;
+  int pushed;
+
+  /* Fast path: A single load once the constructor has run.  */
+  if (*(volatile pth_once_t *)once == ONCE_DONE)
+    return TRUE;
+
+  implicit_init ();
+
+  for (;;)
+    {
+      if (InterlockedCompareExchange ((volatile LONG *)once,
+                                      ONCE_RUNNING, ONCE_INIT) == ONCE_INIT)
+        {
+          pushed = pth_cleanup_push (once_abandon, once);
+          constructor (arg);
+          if (pushed)
+            pth_cleanup_pop (0);
+          once_finish (once, ONCE_DONE);
+          return TRUE;
+        }
+
+      if (*(volatile pth_once_t *)once == ONCE_DONE)
+        return TRUE;
+
+      /* The constructor is running in another thread which is
+         currently inside of pth; park until it is done or has been
+         abandoned.  */
+      wait.once = once;
+      wait.ev = CreateEvent (NULL, FALSE, FALSE, NULL);
+      if (!wait.ev)
+        {
+          set_errno (map_w32_to_errno (GetLastError ()));
+          return FALSE;
+        }
+      wait.next = once_waiters;
+      once_waiters = &wait;
+
+      enter_pth (__FUNCTION__);
+      WaitForSingleObject (wait.ev, INFINITE);
       leave_pth (__FUNCTION__);
+
+      CloseHandle (wait.ev);
+    }
+}
+
+
+pth_attr_t
+pth_attr_new (void)
+{
+  pth_attr_t hd;
+
+  implicit_init ();
+  hd = _pth_calloc (1, sizeof *hd);
+  return hd;
+}
+
+
+/* Drop a reference to the thread info TI.  Must be called with the
+   world lock held.  */
+static void
+unref_thread_info (struct thread_info_s *ti)
+{
+  struct cleanup_s *cu;
+  struct rdlock_s *rl;
+
+  if (ti == &main_thread_info || --ti->refs)
+    return;
+  while ((cu = ti->cleanups))
+    {
+      ti->cleanups = cu->next;
+      _pth_free (cu);
+    }
+  while ((rl = ti->rdlocks))
+    {
+      ti->rdlocks = rl->next;
+      _pth_free (rl);
+    }
+  if (ti->cancel_ev)
+    CloseHandle (ti->cancel_ev);
+  if (ti->name)
+    _pth_free (ti->name);
+  _pth_free (ti);
+}
+
+
+int
+pth_attr_destroy (pth_attr_t hd)
+{
+  if (!hd)
+    return -1;
+  implicit_init ();
+  if (hd->bound)
+    unref_thread_info (hd->bound);
+  if (hd->name)
+    _pth_free (hd->name);
+  _pth_free (hd);
+  return TRUE;
+}
+
+
+/* Return the info of the thread TID or NULL.  Must be called with
+   the world lock held.  */
+static struct thread_info_s *
+find_thread (pth_t tid)
+{
+  struct thread_info_s *ti;
+
+  /* pth_self returns the same pseudo handle in all threads.  */
+  if (tid == GetCurrentThread ())
+    return current_thread_info ();
+  for (ti = thread_list; ti; ti = ti->next)
+    if (tid && ti->th == tid)
+      break;
+  return ti;
+}
+
+
+/* Return a new attribute object bound to the thread TID.  The read
+   only attributes of that object give the state and statistics of
+   the thread.  The object must be released with pth_attr_destroy.  */
+pth_attr_t
+pth_attr_of (pth_t tid)
+{
+  struct thread_info_s *ti;
+  pth_attr_t hd;
+
+  implicit_init ();
+
+  ti = find_thread (tid);
+  if (!ti)
+    {
+      set_errno (ESRCH);
+      return NULL;
+    }
+
+  hd = _pth_calloc (1, sizeof *hd);
+  if (!hd)
+    return NULL;
+  hd->bound = ti;
+  ti->refs++;
+  return hd;
+}
+
+
+int
+pth_attr_get (pth_attr_t hd, int field, ...)
+{
+  struct thread_info_s *ti;
+  va_list args;
+  int rc = TRUE;
+
+  implicit_init ();
+
+  if (!hd)
+    {
+      set_errno (EINVAL);
       return FALSE;
     }
-    
+  ti = hd->bound;
+
+  va_start (args, field);
+  switch (field)
+    {
+    case PTH_ATTR_JOINABLE:
+      *va_arg (args, int *) = (ti? ti->joinable
+                               : !!(hd->flags & PTH_ATTR_JOINABLE));
+      break;
+
+    case PTH_ATTR_STACK_SIZE:
+      *va_arg (args, unsigned int *) = ti? ti->stack_size : hd->stack_size;
+      break;
+
+    case PTH_ATTR_NAME:
+      *va_arg (args, char **) = ti? ti->name : hd->name;
+      break;
+
+    case PTH_ATTR_BOUND:
+      *va_arg (args, int *) = !!ti;
+      break;
+
+    case PTH_ATTR_CANCEL_STATE:
+      *va_arg (args, unsigned int *) = (ti? ti->cancel_state
+                                        : hd->cancel_state
+                                        ? hd->cancel_state
+                                        : PTH_CANCEL_DEFAULT);
+      break;
+
+    case PTH_ATTR_DISPATCHES:
+    case PTH_ATTR_TIME_SPAWN:
+    case PTH_ATTR_TIME_LAST:
+    case PTH_ATTR_TIME_RAN:
+    case PTH_ATTR_START_FUNC:
+    case PTH_ATTR_START_ARG:
+    case PTH_ATTR_STATE:
+    case PTH_ATTR_EVENTS:
+      if (!ti)
+        {
+          set_errno (EINVAL);
+          rc = FALSE;
+        }
+      else if (field == PTH_ATTR_DISPATCHES)
+        *va_arg (args, int *) = ti->dispatches;
+      else if (field == PTH_ATTR_TIME_SPAWN)
+        *va_arg (args, pth_time_t *) = ti->spawned;
+      else if (field == PTH_ATTR_TIME_LAST)
+        usec_to_time (perf_base_usec
+                      + ticks_to_usec (ti->last_dispatch - perf_base),
+                      va_arg (args, pth_time_t *));
+      else if (field == PTH_ATTR_TIME_RAN)
+        {
+          LONGLONG ran = ti->ran;
+
+          /* Add the current slice of the running thread.  */
+          if (ti == current_thread_info ())
+            ran += perf_counter () - ti->last_dispatch;
+          usec_to_time (ticks_to_usec (ran), va_arg (args, pth_time_t *));
+        }
+      else if (field == PTH_ATTR_START_FUNC)
+        *va_arg (args, void *(**)(void *)) = ti->thread;
+      else if (field == PTH_ATTR_START_ARG)
+        *va_arg (args, void **) = ti->arg;
+      else if (field == PTH_ATTR_STATE)
+        *va_arg (args, pth_state_t *) = ti->state;
+      else
+        *va_arg (args, pth_event_t *) = NULL;  /* Not tracked.  */
+      break;
+
+    default:
+      set_errno (EINVAL);
+      rc = FALSE;
+      break;
+    }
+  va_end (args);
+  return rc;
+}
+
+
+int
+pth_attr_set (pth_attr_t hd, int field, ...)
+{    
+  va_list args;
+  char * str;
+  int val;
+  int rc = TRUE;
+
+  implicit_init ();
+
+  va_start (args, field);
+  switch (field)
+    {
+    case PTH_ATTR_JOINABLE:
+      val = va_arg (args, int);
+      if (val)
+        {
+          hd->flags |= PTH_ATTR_JOINABLE;
+          if (DBG_INFO)
+            _pth_debug (0, "pth_attr_set: PTH_ATTR_JOINABLE\n");
+        }
+      break;
+
+    case PTH_ATTR_STACK_SIZE:
+      val = va_arg (args, int);
+      if (val)
+        {
+          hd->flags |= PTH_ATTR_STACK_SIZE;
+          hd->stack_size = val;
+          if (DBG_INFO)
+            _pth_debug (0, "pth_attr_set: PTH_ATTR_STACK_SIZE %d\n",
+                        val);
+        }
+      break;
+
+    case PTH_ATTR_CANCEL_STATE:
+      hd->cancel_state = va_arg (args, unsigned int);
+      break;
+
+    case PTH_ATTR_NAME:
+      str = va_arg (args, char*);
+      if (hd->name)
+        _pth_free (hd->name);
+      if (str)
+        {
+          hd->name = strdup (str);
+          if (!hd->name)
+            return FALSE;
+          hd->flags |= PTH_ATTR_NAME;
+          if (DBG_INFO)
+            _pth_debug (0, "pth_attr_set: PTH_ATTR_NAME %s\n",
+                        hd->name);
+        }
+      break;
+
+    default:
+      rc = FALSE;
+      break;
+    }
+  va_end (args);
+  return rc;
+}
+
+
+/* Create a suspended thread running FUNC with ARG.  Its info is
+   stored at R_CTX.  */
+static pth_t
+do_pth_spawn (pth_attr_t hd, void *(*func)(void *), void *arg,
+              struct thread_info_s **r_ctx)
+{
+  SECURITY_ATTRIBUTES sa;
+  DWORD tid;
+  HANDLE th;
+  struct thread_info_s *ctx;
+
+  if (!hd)
+    return NULL;
+
+  memset (&sa, 0, sizeof sa);
+  sa.bInheritHandle = TRUE;
+  sa.lpSecurityDescriptor = NULL;
+  sa.nLength = sizeof sa;
+
+  ctx = _pth_calloc (1, sizeof *ctx);
+  if (!ctx)
+    return NULL;
+  ctx->thread = func;
+  ctx->arg = arg;
+  ctx->joinable = (hd->flags & PTH_ATTR_JOINABLE);
+  ctx->stack_size = hd->stack_size? hd->stack_size : default_stack_size;
+  /* A joinable thread stays around until it has been joined.  */
+  ctx->refs = ctx->joinable? 2 : 1;
+  ctx->state = PTH_STATE_NEW;
+  ctx->cancel_state = hd->cancel_state? hd->cancel_state : PTH_CANCEL_DEFAULT;
+  ctx->cancel_ev = CreateEvent (NULL, TRUE, FALSE, NULL);
+  if (!ctx->cancel_ev)
+    {
+      _pth_free (ctx);
+      return NULL;
+    }
+  usec_to_time (current_time_usec (), &ctx->spawned);
+  if (hd->name)
+    {
+      ctx->name = strdup (hd->name);
+      if (!ctx->name)
+        {
+          CloseHandle (ctx->cancel_ev);
+          _pth_free (ctx);
+          return NULL;
+        }
+    }
+
+  /* XXX: we don't use all thread attributes. */
+
+  /* Note that we create the thread suspended so that we are able to
+     store the thread's handle in the context structure.  We need to
+     do this to be able to close the handle from the launch helper. 
+     The stack size is only reserved; pages are committed by the
+     system as the stack grows.
+
+     FIXME: We should not use W32's thread handle directly but keep
+     our own thread control structure.  CTX may be used for that.  */
+  if (DBG_INFO)
+    _pth_debug (0, "do_pth_spawn creating thread ...\n");
+  th = CreateThread (&sa, ctx->stack_size,
+                     (LPTHREAD_START_ROUTINE)launch_thread,
+                     ctx, CREATE_SUSPENDED | STACK_SIZE_PARAM_IS_A_RESERVATION,
+                     &tid);
+  ctx->th = th;
+  if (DBG_INFO)
+    _pth_debug (0, "do_pth_spawn created thread %p\n", th);
+  if (!th)
+    {
+      CloseHandle (ctx->cancel_ev);
+      if (ctx->name)
+        _pth_free (ctx->name);
+      _pth_free (ctx);
+      ctx = NULL;
+    }
+  *r_ctx = ctx;
+  return th;
+}
+
+/* Start the thread CTX created by do_pth_spawn.  Must be called with
+   the world lock held.  */
+static void
+start_spawned (struct thread_info_s *ctx)
+{
+  /* Link the thread while it is suspended so that pth_attr_of finds
+     it right away.  */
+  ctx->next = thread_list;
+  thread_list = ctx;
+  ResumeThread (ctx->th);
+}
+
+
+/* Release the thread CTX created by do_pth_spawn without starting
+   it.  The thread has not run any code yet.  */
+static void
+discard_spawned (struct thread_info_s *ctx)
+{
+  TerminateThread (ctx->th, 0);
+  CloseHandle (ctx->th);
+  CloseHandle (ctx->cancel_ev);
+  if (ctx->name)
+    _pth_free (ctx->name);
+  _pth_free (ctx);
+}
+
+
+pth_t
+pth_spawn (pth_attr_t hd, void *(*func)(void *), void *arg)
+{
+  struct thread_info_s *ctx;
+  HANDLE th;
+
+  if (!hd)
+    return NULL;
+
+  implicit_init ();
+  enter_pth (__FUNCTION__);
+  th = do_pth_spawn (hd, func, arg, &ctx);
   leave_pth (__FUNCTION__);
-  return TRUE;
+  if (th)
+    start_spawned (ctx);
+  return th;
 }
 
 
-/* Destroy the mutex MUTEX.  */
+/* Spawn COUNT threads with the attributes HD running FUNC.  Thread I
+   gets ARGS[I] as argument, or NULL if ARGS is NULL.  The handles of
+   the spawned threads are stored in order at TIDS unless it is NULL.
+   The threads are created with a single entry into pth and started
+   only after all of them have been created.  If TOGETHER is set,
+   either all or none are spawned.  Returns the number of spawned
+   threads or -1 on error.  */
 int
-pth_mutex_destroy (pth_mutex_t *mutex)
+pth_spawn_n (pth_attr_t hd, int count, void *(*func)(void *),
+             void *const *args, pth_t *tids, int together)
 {
+  struct thread_info_s **ctxs;
+  struct thread_info_s *ctx;
+  int i, n;
+
+  if (!hd || !func || count <= 0)
+    {
+      set_errno (EINVAL);
+      return -1;
+    }
+
   implicit_init ();
+
+  ctxs = _pth_calloc (count, sizeof *ctxs);
+  if (!ctxs)
+    return -1;
+
   enter_pth (__FUNCTION__);
+  for (i = n = 0; i < count; i++)
+    {
+      if (!do_pth_spawn (hd, func, args? args[i] : NULL, &ctx))
+        {
+          if (together)
+            break;
+          continue;
+        }
+      ctxs[n++] = ctx;
+    }
+  leave_pth (__FUNCTION__);
+
+  if (together && n < count)
+    {
+      for (i = 0; i < n; i++)
+        discard_spawned (ctxs[i]);
+      n = 0;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      if (tids)
+        tids[i] = ctxs[i]->th;
+      start_spawned (ctxs[i]);
+    }
+  _pth_free (ctxs);
+
+  if (!n)
+    {
+      set_errno (EAGAIN);
+      return -1;
+    }
+  return n;
+}
+
+
+pth_t 
+pth_self (void)
+{
+  return GetCurrentThread ();
+}
+
+
+/* Special W32 function to cope with the problem that pth_self returns
+   just a pseudo handle which is not very useful for debugging.  */
+unsigned long 
+pth_thread_id (void)
+{
+  return GetCurrentThreadId ();
+}
+
+
+int
+pth_key_create (pth_key_t *key, void (*destructor)(void *))
+{
+  int i;
+
+  implicit_init ();
+
+  for (i = 0; i < PTH_KEY_MAX; i++)
+    if (!key_table[i].used)
+      {
+        key_table[i].used = 1;
+        key_table[i].destructor = destructor;
+        *key = i;
+        return TRUE;
+      }
+  set_errno (EAGAIN);
+  return FALSE;
+}
+
+
+/* Delete KEY.  The destructor is not called for existing values.  */
+int
+pth_key_delete (pth_key_t key)
+{
+  implicit_init ();
+
+  if (key < 0 || key >= PTH_KEY_MAX || !key_table[key].used)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  key_table[key].used = 0;
+  key_table[key].destructor = NULL;
+  return TRUE;
+}
+
+
+/* Set the value of KEY for the current thread.  This does not enter
+   pth.  */
+int
+pth_key_setdata (pth_key_t key, const void *value)
+{
+  void **values;
+
+  implicit_init ();
+
+  if (key < 0 || key >= PTH_KEY_MAX || !key_table[key].used)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  values = TlsGetValue (key_tls_slot);
+  if (!values)
+    {
+      if (!value)
+        return TRUE;
+      values = _pth_calloc (PTH_KEY_MAX, sizeof *values);
+      if (!values)
+        return FALSE;
+      TlsSetValue (key_tls_slot, values);
+    }
+  values[key] = (void *)value;
+  return TRUE;
+}
+
+
+/* Return the value of KEY for the current thread or NULL.  This does
+   not enter pth.  */
+void *
+pth_key_getdata (pth_key_t key)
+{
+  void **values;
+
+  if (key < 0 || key >= PTH_KEY_MAX || key_tls_slot == TLS_OUT_OF_INDEXES)
+    return NULL;
+  values = TlsGetValue (key_tls_slot);
+  return values? values[key] : NULL;
+}
+
+
+/* Run the destructors for the keys of the current thread and release
+   its value array.  Must be called with the world lock held.  */
+static void
+destroy_thread_keys (void)
+{
+  void **values;
+  void *value;
+  int i, round, again;
+
+  if (key_tls_slot == TLS_OUT_OF_INDEXES)
+    return;
+  values = TlsGetValue (key_tls_slot);
+  if (!values)
+    return;
+
+  for (round = 0; round < KEY_DESTRUCTOR_ITERATIONS; round++)
+    {
+      again = 0;
+      for (i = 0; i < PTH_KEY_MAX; i++)
+        if (values[i])
+          {
+            value = values[i];
+            values[i] = NULL;
+            if (key_table[i].used && key_table[i].destructor)
+              {
+                key_table[i].destructor (value);
+                again = 1;
+              }
+          }
+      if (!again)
+        break;
+    }
+  TlsSetValue (key_tls_slot, NULL);
+  _pth_free (values);
+}
+
+
+/* Wait for the joinable thread HD to terminate and store its exit
+   value at VALUE.  Joining with any thread (HD being NULL) is not
+   supported.  */
+int
+pth_join (pth_t hd, void **value)
+{
+  struct thread_info_s *ti;
+
+  implicit_init ();
+
+  ti = hd? find_thread (hd) : NULL;
+  if (!ti || !ti->joinable || ti->joined)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  if (ti == current_thread_info ())
+    {
+      set_errno (EDEADLK);
+      return FALSE;
+    }
 
-  CloseHandle (*mutex);
+  ti->joined = 1;
+  if (ti->state != PTH_STATE_DEAD)
+    {
+      enter_pth (__FUNCTION__);
+      WaitForSingleObject (ti->th, INFINITE);
+      leave_pth (__FUNCTION__);
+    }
 
-  leave_pth (__FUNCTION__);
+  if (value)
+    *value = ti->exit_value;
+  unlink_thread (ti);
+  CloseHandle (ti->th);
+  ti->th = NULL;
+  unref_thread_info (ti);
   return TRUE;
 }
 
 
-int
-pth_rwlock_init (pth_rwlock_t *rwlock)
+/* Return true if the calling thread shall act on a cancellation
+   request.  */
+static int
+cancel_requested (void)
 {
-  /* FIXME */
-  return pth_mutex_init (rwlock);
+  struct thread_info_s *ti = current_thread_info ();
+
+  return (ti && ti->cancel_pending
+          && (ti->cancel_state & PTH_CANCEL_ENABLE));
 }
 
 
-int
-pth_rwlock_acquire (pth_rwlock_t *rwlock, int op, int try, pth_event_t ev)
+/* Return true if the calling thread may be cancelled.  */
+static int
+cancel_enabled (void)
 {
-  /* FIXME */
-  return pth_mutex_acquire (rwlock, try, ev);
-}
+  struct thread_info_s *ti = current_thread_info ();
 
-int
-pth_rwlock_release (pth_rwlock_t *rwlock)
-{
-  /* FIXME */
-  return pth_mutex_release (rwlock);
+  return (ti && ti->cancel_ev && (ti->cancel_state & PTH_CANCEL_ENABLE));
 }
 
 
-pth_attr_t
-pth_attr_new (void)
+/* Terminate the calling thread with PTH_CANCELED if a cancellation
+   request is pending and cancellation is enabled.  This is the
+   cancellation point; it must be called with the world lock held and
+   without resources of the library being in use.  */
+static void
+test_cancel (void)
 {
-  pth_attr_t hd;
-
-  implicit_init ();
-  hd = _pth_calloc (1, sizeof *hd);
-  return hd;
+  if (cancel_requested ())
+    exit_thread (current_thread_info (), PTH_CANCELED);
 }
 
 
+/* Request cancellation of the thread HD.  Cancellation is deferred:
+   The thread terminates at its next cancellation point, that is in
+   pth_wait, pth_sleep, pth_usleep, the I/O functions, while waiting
+   in pth_mutex_acquire, pth_rwlock_acquire or pth_sem_acquire, and
+   in pth_cancel_point, after its cleanup handlers have run.  A wait
+   already in progress at a cancellation point is interrupted.
+   PTH_CANCEL_ASYNCHRONOUS is treated as deferred.  */
 int
-pth_attr_destroy (pth_attr_t hd)
+pth_cancel (pth_t hd)
 {
-  if (!hd)
-    return -1;
+  struct thread_info_s *ti;
+
   implicit_init ();
-  if (hd->name)
-    _pth_free (hd->name);
-  _pth_free (hd);
+
+  ti = find_thread (hd);
+  if (!ti || ti == &main_thread_info || ti->state == PTH_STATE_DEAD)
+    {
+      set_errno (ESRCH);
+      return FALSE;
+    }
+  ti->cancel_pending = 1;
+  SetEvent (ti->cancel_ev);
+  if (ti == current_thread_info ())
+    test_cancel ();
   return TRUE;
 }
 
 
+/* Cancel the thread HD regardless of its cancellation state.  The
+   thread still terminates only at a cancellation point; a thread
+   computing without reaching one must call pth_cancel_point.  */
 int
-pth_attr_set (pth_attr_t hd, int field, ...)
-{    
-  va_list args;
-  char * str;
-  int val;
-  int rc = TRUE;
+pth_abort (pth_t hd)
+{
+  struct thread_info_s *ti;
 
   implicit_init ();
 
-  va_start (args, field);
-  switch (field)
+  ti = find_thread (hd);
+  if (!ti || ti == &main_thread_info || ti->state == PTH_STATE_DEAD)
     {
-    case PTH_ATTR_JOINABLE:
-      val = va_arg (args, int);
-      if (val)
-        {
-          hd->flags |= PTH_ATTR_JOINABLE;
-          if (DBG_INFO)
-            _pth_debug (0, "pth_attr_set: PTH_ATTR_JOINABLE\n");
-        }
-      break;
-
-    case PTH_ATTR_STACK_SIZE:
-      val = va_arg (args, int);
-      if (val)
-        {
-          hd->flags |= PTH_ATTR_STACK_SIZE;
-          hd->stack_size = val;
-          if (DBG_INFO)
-            _pth_debug (0, "pth_attr_set: PTH_ATTR_STACK_SIZE %d\n",
-                        val);
-        }
-      break;
-
-    case PTH_ATTR_NAME:
-      str = va_arg (args, char*);
-      if (hd->name)
-        _pth_free (hd->name);
-      if (str)
-        {
-          hd->name = strdup (str);
-          if (!hd->name)
-            return FALSE;
-          hd->flags |= PTH_ATTR_NAME;
-          if (DBG_INFO)
-            _pth_debug (0, "pth_attr_set: PTH_ATTR_NAME %s\n",
-                        hd->name);
-        }
-      break;
-
-    default:
-      rc = FALSE;
-      break;
+      set_errno (ESRCH);
+      return FALSE;
     }
-  va_end (args);
-  return rc;
+  ti->cancel_state = PTH_CANCEL_DEFAULT;
+  return pth_cancel (hd);
 }
 
 
-static pth_t
-do_pth_spawn (pth_attr_t hd, void *(*func)(void *), void *arg)
-{
-  SECURITY_ATTRIBUTES sa;
-  DWORD tid;
-  HANDLE th;
-  struct thread_info_s *ctx;
-
-  if (!hd)
-    return NULL;
-
-  memset (&sa, 0, sizeof sa);
-  sa.bInheritHandle = TRUE;
-  sa.lpSecurityDescriptor = NULL;
-  sa.nLength = sizeof sa;
-
-  ctx = _pth_calloc (1, sizeof *ctx);
-  if (!ctx)
-    return NULL;
-  ctx->thread = func;
-  ctx->arg = arg;
-  ctx->joinable = (hd->flags & PTH_ATTR_JOINABLE);
-
-  /* XXX: we don't use all thread attributes. */
-
-  /* Note that we create the thread suspended so that we are able to
-     store the thread's handle in the context structure.  We need to
-     do this to be able to close the handle from the launch helper. 
-
-     FIXME: We should not use W32's thread handle directly but keep
-     our own thread control structure.  CTX may be used for that.  */
-  if (DBG_INFO)
-    _pth_debug (0, "do_pth_spawn creating thread ...\n");
-  th = CreateThread (&sa, hd->stack_size,
-                     (LPTHREAD_START_ROUTINE)launch_thread,
-                     ctx, CREATE_SUSPENDED, &tid);
-  ctx->th = th;
-  if (DBG_INFO)
-    _pth_debug (0, "do_pth_spawn created thread %p\n", th);
-  if (!th)
-    _pth_free (ctx);
-  else
-    ResumeThread (th);
-  
-  return th;
-}
-
-pth_t
-pth_spawn (pth_attr_t hd, void *(*func)(void *), void *arg)
+/* Set the cancellation state of the calling thread to NEWSTATE unless
+   it is 0 and store the old state at OLDSTATE unless it is NULL.  */
+int
+pth_cancel_state (int newstate, int *oldstate)
 {
-  HANDLE th;
-
-  if (!hd)
-    return NULL;
+  struct thread_info_s *ti;
 
   implicit_init ();
-  enter_pth (__FUNCTION__);
-  th = do_pth_spawn (hd, func, arg);
-  leave_pth (__FUNCTION__);
-  return th;
-}
-
 
-pth_t 
-pth_self (void)
-{
-  return GetCurrentThread ();
-}
-
-
-/* Special W32 function to cope with the problem that pth_self returns
-   just a pseudo handle which is not very useful for debugging.  */
-unsigned long 
-pth_thread_id (void)
-{
-  return GetCurrentThreadId ();
+  ti = current_thread_info ();
+  if (!ti)
+    {
+      set_errno (ESRCH);
+      return FALSE;
+    }
+  if (oldstate)
+    *oldstate = ti->cancel_state;
+  if (newstate)
+    ti->cancel_state = newstate;
+  return TRUE;
 }
 
 
-int
-pth_join (pth_t hd, void **value)
+/* An explicit cancellation point.  */
+void
+pth_cancel_point (void)
 {
-#warning fixme: We need to implement this.
-  return TRUE;
+  implicit_init ();
+  test_cancel ();
 }
 
 
-/* friendly */
+/* Push a cleanup handler FUNC with argument ARG.  The handler is run
+   when the thread is cancelled or calls pth_exit.  */
 int
-pth_cancel (pth_t hd)
+pth_cleanup_push (void (*func)(void *), void *arg)
 {
-  int ok = 0;
+  struct thread_info_s *ti;
+  struct cleanup_s *cu;
 
-  if (!hd)
-    return -1;
   implicit_init ();
-  enter_pth (__FUNCTION__);
-  WaitForSingleObject (hd, 1000);
-  if (TerminateThread (hd, 0))
-    ok = 1;
-  leave_pth (__FUNCTION__);
-  if (ok)
-    thread_counter--;
+
+  ti = current_thread_info ();
+  if (!ti || !func)
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  cu = _pth_malloc (sizeof *cu);
+  if (!cu)
+    return FALSE;
+  cu->func = func;
+  cu->arg = arg;
+  cu->next = ti->cleanups;
+  ti->cleanups = cu;
   return TRUE;
 }
 
 
-/* cruel */
+/* Pop the last cleanup handler and run it if EXECUTE is set.  */
 int
-pth_abort (pth_t hd)
+pth_cleanup_pop (int execute)
 {
-  int ok = 0;
+  struct thread_info_s *ti;
+  struct cleanup_s *cu;
 
-  if (!hd)
-    return -1;
   implicit_init ();
-  enter_pth (__FUNCTION__);
-  if (TerminateThread (hd, 0))
-    ok = 1;
-  leave_pth (__FUNCTION__);
-  if (ok)
-    thread_counter--;
+
+  ti = current_thread_info ();
+  if (!ti || !(cu = ti->cleanups))
+    {
+      set_errno (EINVAL);
+      return FALSE;
+    }
+  ti->cleanups = cu->next;
+  if (execute)
+    cu->func (cu->arg);
+  _pth_free (cu);
   return TRUE;
 }
 
 
+/* Terminate the calling thread with VALUE as exit value for pth_join.
+   If called by the main thread or a thread not started by pth_spawn,
+   the process is terminated instead.  */
 void
 pth_exit (void *value)
 {
+  struct thread_info_s *ti;
+
   implicit_init ();
+  ti = current_thread_info ();
+  if (ti && ti != &main_thread_info)
+    exit_thread (ti, value);
+
   enter_pth (__FUNCTION__);
   pth_kill ();
   leave_pth (__FUNCTION__);
@@ -2012,6 +4977,11 @@ do_pth_event_body (unsigned long spec, va_list arg)
       ev->u_type = PTH_EVENT_MUTEX;
       ev->u.mx = va_arg (arg, pth_mutex_t*);
     }
+  else if (spec & PTH_EVENT_SEM)
+    {
+      ev->u_type = PTH_EVENT_SEM;
+      ev->u.sem = va_arg (arg, pth_sem_t*);
+    }
   else if (spec & PTH_EVENT_SELECT)
     {
       struct fdarray_item_s fdarray[FD_SETSIZE];
@@ -2108,6 +5078,98 @@ pth_event_concat (pth_event_t head, ...)
 }
 
 
+static void
+unlink_thread (struct thread_info_s *c)
+{
+  struct thread_info_s **p;
+
+  for (p = &thread_list; *p; p = &(*p)->next)
+    if (*p == c)
+      {
+        *p = c->next;
+        break;
+      }
+}
+
+
+/* Return the number of committed bytes of the stack containing the
+   address ADDR.  */
+static size_t
+stack_commit (void *addr)
+{
+  MEMORY_BASIC_INFORMATION mbi;
+  char *p;
+  void *base;
+  size_t total = 0;
+
+  if (!VirtualQuery (addr, &mbi, sizeof mbi))
+    return 0;
+  base = mbi.AllocationBase;
+  for (p = base; VirtualQuery (p, &mbi, sizeof mbi)
+         && mbi.AllocationBase == base; p += mbi.RegionSize)
+    if (mbi.State == MEM_COMMIT)
+      total += mbi.RegionSize;
+  return total;
+}
+
+
+/* Return the committed stack memory of all threads started by
+   pth_spawn.  */
+static long
+stack_commit_total (void)
+{
+  struct thread_info_s *c;
+  size_t total = 0;
+
+  for (c = thread_list; c; c = c->next)
+    if (c->stack)
+      total += stack_commit (c->stack);
+  return total > LONG_MAX? LONG_MAX : (long)total;
+}
+
+
+/* Terminate the thread C, which is the calling thread, with the exit
+   value VALUE.  Must be called with the world lock held.  A joinable
+   thread stays in THREAD_LIST until pth_join has been called.  */
+static void
+exit_thread (struct thread_info_s *c, void *value)
+{
+  struct cleanup_s *cu;
+
+  /* Cancellation requests are ignored from now on.  */
+  c->cancel_state = PTH_CANCEL_DISABLE;
+  while ((cu = c->cleanups))
+    {
+      c->cleanups = cu->next;
+      cu->func (cu->arg);
+      _pth_free (cu);
+    }
+  c->exit_value = value;
+  destroy_thread_keys ();
+  if (!c->joinable)
+    {
+      unlink_thread (c);
+      if (c->th)
+        {
+          CloseHandle (c->th);
+          c->th = NULL;
+        }
+    }
+  thread_counter--;
+
+  /* FIXME: We would badly fail if someone accesses the now
+     deallocated handle. Don't use it directly but setup proper
+     scheduling queues.  */
+  c->ran += perf_counter () - c->last_dispatch;
+  c->state = PTH_STATE_DEAD;
+  c->stack = NULL;
+  TlsSetValue (thread_tls_slot, NULL);
+  unref_thread_info (c);
+  enter_pth (__FUNCTION__);
+  ExitThread (0);
+}
+
+
 static void *
 launch_thread (void *arg)
 {
@@ -2115,22 +5177,12 @@ launch_thread (void *arg)
 
   if (c)
     {
+      TlsSetValue (thread_tls_slot, c);
       leave_pth (__FUNCTION__);
 
       thread_counter++;
-      c->thread (c->arg);
-      if (!c->joinable && c->th)
-        {
-          CloseHandle (c->th);
-          c->th = NULL;
-        }
-      thread_counter--;
-
-      /* FIXME: We would badly fail if someone accesses the now
-         deallocated handle. Don't use it directly but setup proper
-         scheduling queues.  */
-      enter_pth (__FUNCTION__);
-      _pth_free (c);
+      c->stack = &c;
+      exit_thread (c, c->thread (c->arg));
     }
   ExitThread (0);
   return NULL;
@@ -2289,16 +5341,27 @@ event_count (pth_event_t ev)
 
 
 
+/* Wait for the events in the ring EV.  If CANCELABLE is set, the wait
+   is also terminated by a cancellation request for the calling
+   thread; in this case -1 is returned with ERRNO set to EINTR unless
+   some of the events occurred as well.  */
 static int
-do_pth_wait (pth_event_t ev)
+do_pth_wait_ex (pth_event_t ev, int cancelable)
 {
   char strerr[256];
-  HANDLE waitbuf[MAXIMUM_WAIT_OBJECTS/2];
+  /* One extra slot for the cancel event.  */
+  HANDLE waitbuf[MAXIMUM_WAIT_OBJECTS/2 + 1];
   pth_event_t evarray[MAXIMUM_WAIT_OBJECTS/2];
   DWORD n;
+  DWORD timeout = INFINITE;
   int pos, idx, thlstidx, i;
   pth_event_t r;
   int count;
+  int nwait;
+  int nsem = 0;
+  struct thread_info_s *ti;
+  struct sem_s *sem;
+  HANDLE wakeup;
 
   TRACE_BEG (DEBUG_INFO, "do_pth_wait", ev);
 
@@ -2438,6 +5501,33 @@ do_pth_wait (pth_event_t ev)
             _pth_debug (0, "pth_wait: ignoring mutex event.\n");
           break;
 
+        case PTH_EVENT_SEM:
+          /* Like pth_sem_acquire we announce ourself before trying
+             to decrement the semaphore.  If that already succeeds
+             the other events are only polled.  */
+          sem = r->u.sem? SEM_OF (r->u.sem) : NULL;
+          wakeup = sem? lazy_semaphore (&sem->wakeup) : NULL;
+          if (!wakeup)
+            {
+              if (DBG_ERROR)
+                _pth_debug (0, "pth_wait: ignoring invalid semaphore "
+                            "event.\n");
+              break;
+            }
+          InterlockedIncrement (&sem->waiting);
+          if (sem_try (sem))
+            {
+              InterlockedDecrement (&sem->waiting);
+              r->status = PTH_STATUS_OCCURRED;
+              nsem++;
+              timeout = 0;
+              break;
+            }
+          TRACE_LOG ("adding semaphore event");
+          evarray[pos] = r;
+          waitbuf[pos++] = wakeup;
+          break;
+
 	default:
           if (DBG_ERROR)
             _pth_debug (0, "pth_wait: unhandled event type 0x%x.\n",
@@ -2455,18 +5545,42 @@ do_pth_wait (pth_event_t ev)
       for (i = 0; i < pos; i++)
         TRACE_LOG2 ("      %d=%p", i, waitbuf[i]);
     }
+  nwait = pos;
+  ti = cancelable? current_thread_info () : NULL;
+  if (ti && ti->cancel_ev && (ti->cancel_state & PTH_CANCEL_ENABLE))
+    waitbuf[nwait++] = ti->cancel_ev;
+
   TRACE_LOG ("now wait");
-  n = WaitForMultipleObjects (pos, waitbuf, FALSE, INFINITE);
+  n = WaitForMultipleObjects (nwait, waitbuf, FALSE, timeout);
   TRACE_LOG1 ("WFMO returned %ld", n);
-  count = 0;
+  count = nsem;
 
   /* Walk over all events with an assigned handle and update the
      status.  Note: This may override the return value of WFMO.  */
   for (idx = 0; idx < pos; idx++)
     {
       r = evarray[idx];
+
+      if (r->u_type == PTH_EVENT_SEM)
+        {
+          /* The wakeup semaphore is not polled because that would
+             take a token meant for another waiter.  The event
+             occurred if we decremented the semaphore.  */
+          sem = SEM_OF (r->u.sem);
+          InterlockedDecrement (&sem->waiting);
+          if (sem_try (sem))
+            {
+              r->status = PTH_STATUS_OCCURRED;
+              count++;
+            }
+          continue;
+        }
       
-      if (WaitForSingleObject (waitbuf[idx], 0) == WAIT_OBJECT_0)
+      /* The object which terminated the wait must not be polled
+	 again because WFMO has already consumed the signal of an
+	 auto-reset event or a semaphore.  */
+      if ((n < WAIT_OBJECT_0 + pos && idx == n - WAIT_OBJECT_0)
+	  || WaitForSingleObject (waitbuf[idx], 0) == WAIT_OBJECT_0)
 	{
 	  TRACE_LOG2 ("setting %d ev=%p", idx, r);
 	  r->status = PTH_STATUS_OCCURRED;
@@ -2575,7 +5689,8 @@ do_pth_wait (pth_event_t ev)
 	     global signal event.  Note: This is related to
 	     edge-triggered vs level-triggered.  Level triggered is
 	     doubleplusgood.  */
-	  if (r->u_type != PTH_EVENT_TIME && r->u_type != PTH_EVENT_FD)
+	  if (r->u_type != PTH_EVENT_TIME && r->u_type != PTH_EVENT_FD
+	      && !(r->flags & EVENT_FLAG_NO_RESET))
 	    reset_event (waitbuf[idx]);
 	}
 
@@ -2604,7 +5719,18 @@ do_pth_wait (pth_event_t ev)
   else if (n == WAIT_TIMEOUT)
     return TRACE_SYSRES (0);
   else
-    return TRACE_SYSRES (-1);
+    {
+      if (nwait > pos && n == WAIT_OBJECT_0 + pos)
+        set_errno (EINTR);
+      return TRACE_SYSRES (-1);
+    }
+}
+
+
+static int
+do_pth_wait (pth_event_t ev)
+{
+  return do_pth_wait_ex (ev, 1);
 }
 
 
@@ -2614,9 +5740,11 @@ pth_wait (pth_event_t ev)
   int rc;
 
   implicit_init ();
+  test_cancel ();
   enter_pth (__FUNCTION__);
   rc = do_pth_wait (ev);
   leave_pth (__FUNCTION__);
+  test_cancel ();
   return rc;
 }
 
@@ -2649,6 +5777,7 @@ pth_sleep (int sec)
 #endif
 
   leave_pth (__FUNCTION__);
+  test_cancel ();
   return 0;
 }
 
@@ -2681,6 +5810,7 @@ pth_usleep (unsigned int usec)
 #endif
 
   leave_pth (__FUNCTION__);
+  test_cancel ();
   return 0;
 }
 
@@ -0,0 +1,304 @@
+/* w32-stream.c - Buffered streams on top of pth descriptors.
+ * Copyright (C) 2004, 2006, 2007, 2008, 2010 g10 Code GmbH
+ *
+ * This file is part of W32PTH.
+ *
+ * W32PTH is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * W32PTH is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A stream keeps a read-ahead and a write-behind buffer for a
+   descriptor.  The pointers into these buffers are part of the public
+   structure so that pth_stream_getc and pth_stream_putc can be
+   implemented as macros which touch only memory.  Only a refill or a
+   flush calls into pth_read_ev or pth_write_ev.  A stream must not be
+   used by more than one thread at a time.  */
+
+#include <config.h>
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "pth.h"
+
+#define STREAM_DEFAULT_BUFSIZE 4096
+
+#define STREAM_FLAG_EOF   1
+#define STREAM_FLAG_ERROR 2
+
+
+
+/* Create a new stream for FD with a read buffer of RSIZE and a write
+   buffer of WSIZE bytes.  A size of 0 selects the default size.  The
+   descriptor is not closed by pth_stream_free.  */
+pth_stream_t
+pth_stream_new (int fd, size_t rsize, size_t wsize)
+{
+  pth_stream_t st;
+
+  if (!rsize)
+    rsize = STREAM_DEFAULT_BUFSIZE;
+  if (!wsize)
+    wsize = STREAM_DEFAULT_BUFSIZE;
+  if (rsize > (size_t)-1 - sizeof *st
+      || wsize > (size_t)-1 - sizeof *st - rsize)
+    {
+      set_errno (ENOMEM);  /* The total size would wrap.  */
+      return NULL;
+    }
+
+  st = _pth_calloc (1, sizeof *st + rsize + wsize);
+  if (!st)
+    return NULL;
+  st->fd = fd;
+  st->rbuf = (unsigned char *)(st + 1);
+  st->rsize = rsize;
+  st->wbuf = st->rbuf + rsize;
+  st->wsize = wsize;
+  st->rptr = st->rend = st->rbuf;
+  st->wptr = st->wbuf;
+  st->wend = st->wbuf + wsize;
+  return st;
+}
+
+
+/* Flush and release the stream ST.  Returns -1 if the flush
+   failed.  */
+int
+pth_stream_free (pth_stream_t st)
+{
+  int rc;
+
+  if (!st)
+    return 0;
+  rc = pth_stream_flush (st);
+  _pth_free (st);
+  return rc;
+}
+
+
+/* Return the descriptor of ST.  */
+int
+pth_stream_fd (pth_stream_t st)
+{
+  return st->fd;
+}
+
+
+/* Read into the empty read buffer of ST.  Returns the number of bytes
+   now available, 0 on EOF or -1 on error.  */
+static int
+fill_buffer (pth_stream_t st, pth_event_t ev_extra)
+{
+  int n;
+
+  if ((st->flags & STREAM_FLAG_EOF))
+    return 0;
+
+  n = pth_read_ev (st->fd, st->rbuf, st->rsize, ev_extra);
+  if (n < 0)
+    {
+      if (errno != EINTR)
+        st->flags |= STREAM_FLAG_ERROR;
+      return -1;
+    }
+  if (!n)
+    st->flags |= STREAM_FLAG_EOF;
+  st->rptr = st->rbuf;
+  st->rend = st->rbuf + n;
+  return n;
+}
+
+
+/* Write out the write buffer of ST.  */
+static int
+flush_buffer (pth_stream_t st, pth_event_t ev_extra)
+{
+  unsigned char *p = st->wbuf;
+  int n;
+
+  while (p < st->wptr)
+    {
+      n = pth_write_ev (st->fd, p, st->wptr - p, ev_extra);
+      if (n <= 0)
+        {
+          if (!n)
+            set_errno (EIO);  /* Would loop forever.  */
+          if (errno != EINTR)
+            st->flags |= STREAM_FLAG_ERROR;
+          /* Keep what has not been written.  */
+          memmove (st->wbuf, p, st->wptr - p);
+          st->wptr = st->wbuf + (st->wptr - p);
+          return -1;
+        }
+      p += n;
+    }
+  st->wptr = st->wbuf;
+  return 0;
+}
+
+
+/* Slow path of pth_stream_getc.  */
+int
+_pth_stream_fillbuf (pth_stream_t st)
+{
+  if (st->rptr < st->rend)
+    return *st->rptr++;
+  if (fill_buffer (st, NULL) <= 0)
+    return -1;
+  return *st->rptr++;
+}
+
+
+/* Slow path of pth_stream_putc.  */
+int
+_pth_stream_flsbuf (pth_stream_t st, int c)
+{
+  if (st->wptr == st->wend && flush_buffer (st, NULL))
+    return -1;
+  *st->wptr++ = c;
+  return (unsigned char)c;
+}
+
+
+/* Read up to SIZE bytes from ST into BUFFER.  Returns the number of
+   bytes read, 0 on EOF or -1 on error.  Only one refill is done, so
+   less than SIZE bytes may be returned.  */
+int
+pth_stream_read_ev (pth_stream_t st, void *buffer, size_t size,
+                    pth_event_t ev_extra)
+{
+  size_t n;
+
+  if (!size)
+    return 0;
+
+  n = st->rend - st->rptr;
+  if (!n)
+    {
+      /* Large reads bypass the buffer.  */
+      if (size >= st->rsize && !(st->flags & STREAM_FLAG_EOF))
+        {
+          int rc = pth_read_ev (st->fd, buffer, size, ev_extra);
+          if (!rc)
+            st->flags |= STREAM_FLAG_EOF;
+          else if (rc < 0 && errno != EINTR)
+            st->flags |= STREAM_FLAG_ERROR;
+          return rc;
+        }
+      if (fill_buffer (st, ev_extra) < 0)
+        return -1;
+      n = st->rend - st->rptr;
+    }
+  if (n > size)
+    n = size;
+  memcpy (buffer, st->rptr, n);
+  st->rptr += n;
+  return (int)n;
+}
+
+
+int
+pth_stream_read (pth_stream_t st, void *buffer, size_t size)
+{
+  return pth_stream_read_ev (st, buffer, size, NULL);
+}
+
+
+/* Write SIZE bytes from BUFFER to ST.  Returns SIZE on success.  On
+   error the number of bytes taken from BUFFER so far is returned,
+   like fwrite does, or -1 if none were taken.  */
+int
+pth_stream_write_ev (pth_stream_t st, const void *buffer, size_t size,
+                     pth_event_t ev_extra)
+{
+  const unsigned char *p = buffer;
+  size_t n, left = size;
+  int rc;
+
+  while (left)
+    {
+      if (st->wptr == st->wbuf && left >= st->wsize)
+        {
+          /* Nothing buffered and the data would not fit anyway.  */
+          rc = pth_write_ev (st->fd, p, left, ev_extra);
+          if (rc <= 0)
+            {
+              if (!rc)
+                set_errno (EIO);
+              if (errno != EINTR)
+                st->flags |= STREAM_FLAG_ERROR;
+              break;
+            }
+          p += rc;
+          left -= rc;
+          continue;
+        }
+      n = st->wend - st->wptr;
+      if (n > left)
+        n = left;
+      memcpy (st->wptr, p, n);
+      st->wptr += n;
+      p += n;
+      left -= n;
+      if (left && flush_buffer (st, ev_extra))
+        break;
+    }
+  if (left && left == size)
+    return -1;
+  return (int)(size - left);
+}
+
+
+int
+pth_stream_write (pth_stream_t st, const void *buffer, size_t size)
+{
+  return pth_stream_write_ev (st, buffer, size, NULL);
+}
+
+
+/* Write out all buffered data of ST.  */
+int
+pth_stream_flush_ev (pth_stream_t st, pth_event_t ev_extra)
+{
+  return flush_buffer (st, ev_extra);
+}
+
+
+int
+pth_stream_flush (pth_stream_t st)
+{
+  return pth_stream_flush_ev (st, NULL);
+}
+
+
+/* Return true if EOF has been seen on ST and the read buffer is
+   empty.  */
+int
+pth_stream_eof (pth_stream_t st)
+{
+  return st->rptr == st->rend && (st->flags & STREAM_FLAG_EOF);
+}
+
+
+/* Return true if a read or write error occurred on ST.  */
+int
+pth_stream_error (pth_stream_t st)
+{
+  return !!(st->flags & STREAM_FLAG_ERROR);
+}